@@ -3,12 +3,42 @@
 #include <vulkan/vulkan.hpp>
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <deque>
 #include <functional>
 #include <stdexcept>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <type_traits>
+#include <cmath>
+#include <tuple>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace vkb {
 
@@ -212,6 +242,112 @@ void setup_pNext_chain(T &structure,
   structure.pNext = structs.at(0);
 }
 
+// Persistent worker threads for fork-join loops. parallel_for hands the
+// indices [0, count) out to the workers and the calling thread and returns
+// once all of them ran. The first exception thrown by `func` is rethrown on
+// the calling thread.
+class ThreadPool {
+public:
+  // `thread_count` includes the calling thread, 0 picks one per core.
+  explicit ThreadPool(uint32_t thread_count = 0) {
+    if (thread_count == 0)
+      thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    for (uint32_t i = 1; i < thread_count; ++i)
+      workers.emplace_back([this] { work(); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  uint32_t size() const { return static_cast<uint32_t>(workers.size()) + 1; }
+
+  void parallel_for(size_t count, const std::function<void(size_t)> &func) {
+    if (count == 0)
+      return;
+    if (workers.empty() || count == 1) {
+      for (size_t i = 0; i < count; ++i)
+        func(i);
+      return;
+    }
+
+    std::lock_guard<std::mutex> serial(submit_mutex);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &func;
+      job_count = count;
+      next = 0;
+      busy = workers.size();
+      error = nullptr;
+      generation++;
+    }
+    wake.notify_all();
+    run();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+private:
+  void work() {
+    uint64_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stop || generation != seen; });
+        if (stop)
+          return;
+        seen = generation;
+      }
+      run();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--busy == 0)
+        idle.notify_one();
+    }
+  }
+
+  void run() {
+    for (;;) {
+      size_t i = next.fetch_add(1);
+      if (i >= job_count)
+        return;
+      try {
+        (*job)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex submit_mutex;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  bool stop = false;
+  uint64_t generation = 0;
+
+  const std::function<void(size_t)> *job = nullptr;
+  size_t job_count = 0;
+  std::atomic<size_t> next{0};
+  size_t busy = 0;
+  std::exception_ptr error;
+};
+
 
 
 extern VKAPI_ATTR VkBool32 VKAPI_CALL default_debug_callback(
@@ -597,7 +733,8 @@ struct QueueFamilies {
   QueueFamilies() {}
   virtual ~QueueFamilies() {}
 
-  // TODO: Support MultiQueue Parallel Workload
+  // Multiple queues per family are created with
+  // DeviceBuilder::request_all_queues and handed out by Device::queues.
 
   // finds the first queue which supports graphics operations. returns
   // QUEUE_INDEX_MAX_VALUE if none is found
@@ -1194,233 +1331,3121 @@ private:
 
 #pragma endregion
 
-#pragma region Device
+#pragma region Submission
 
-enum class QueueType { present, graphics, compute, transfer };
+// A point on a QueueTimeline. Values grow monotonically per queue, 0 is
+// always complete.
+using SubmitToken = uint64_t;
 
-struct Device : Agent<vk::Device> {
-  PhysicalDevice physical_device;
-  vk::SurfaceKHR surface;
-  QueueFamilies queue_families;
+// A wait on another queue's timeline, to add to a submission. Empty when the
+// producer could not provide a semaphore (no timeline semaphores) and has
+// already waited on the host instead.
+struct TimelineWait {
+  vk::Semaphore semaphore;
+  SubmitToken value = 0;
+  vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eAllCommands;
 
-  uint32_t get_queue_index(QueueType type) const {
-    uint32_t index = QUEUE_INDEX_MAX_VALUE;
-    switch (type) {
-    case QueueType::present:
-      index = queue_families.get_present_queue_index(
-          physical_device, surface);
-      break;
-    case QueueType::graphics:
-      index = queue_families.get_graphics_queue_index();
-      break;
-    case QueueType::compute:
-      index = queue_families.get_separate_compute_queue_index();
-      break;
-    case QueueType::transfer:
-      index = queue_families.get_separate_transfer_queue_index();
-      break;
-    default:
-      break;
+  explicit operator bool() const { return bool(semaphore); }
+};
+
+// GPU timeline of one queue. Every submission made through it signals the
+// next value, so callers track GPU progress with plain integers instead of
+// fences: resources are reclaimed once completedValue() passes the value of
+// the submission that used them, and frames are paced with waitFor().
+//
+// With timeline semaphores (Vulkan 1.2 or VK_KHR_timeline_semaphore) the
+// value lives in a vk::Semaphore that other queues can also wait on.
+// Without them, each submission carries a recycled fence and the same API
+// is emulated on the host.
+//
+// A vk::Queue must be externally synchronized, so all submissions and
+// presents to the queue should go through its timeline.
+class QueueTimeline {
+public:
+  QueueTimeline(vk::Device device, uint32_t queue_family, vk::Queue queue,
+                bool use_timeline_semaphore,
+                vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr,
+                std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table = nullptr)
+      : device(device), queue_family(queue_family), queue(queue),
+        allocation_callbacks(allocation_callbacks),
+        dispatch_table(std::move(dispatch_table)) {
+    if (use_timeline_semaphore) {
+      vk::SemaphoreTypeCreateInfo type_info{vk::SemaphoreType::eTimeline, 0};
+      vk::SemaphoreCreateInfo info;
+      info.pNext = &type_info;
+      semaphore = device.createSemaphore(info, allocation_callbacks, dispatch());
     }
-    return index;
   }
-  // Only a compute or transfer queue type is valid. All other queue types do
-  // not support a 'dedicated' queue index
-  uint32_t get_dedicated_queue_index(QueueType type) const {
-    uint32_t index = QUEUE_INDEX_MAX_VALUE;
-    switch (type) {
-    case QueueType::compute:
-      index = queue_families.get_dedicated_compute_queue_index();
-      break;
-    case QueueType::transfer:
-      index = queue_families.get_dedicated_transfer_queue_index();
-      break;
-    default:
-      break;
+
+  QueueTimeline(const QueueTimeline &) = delete;
+  QueueTimeline &operator=(const QueueTimeline &) = delete;
+  ~QueueTimeline() { destroy(); }
+
+  // Semaphore values of one vk::SubmitInfo. They pair with its wait and
+  // signal semaphores and are used for timeline semaphores, use 0 for
+  // binary ones. Missing values are 0.
+  struct SubmitValues {
+    std::vector<uint64_t> waits;
+    std::vector<uint64_t> signals;
+  };
+
+  // Submit `info` and return the timeline value it signals. `wait_values`
+  // pairs with info.pWaitSemaphores and gives the value to wait for on
+  // timeline semaphores, use 0 for binary ones. `fence`, if given, is
+  // signaled as well.
+  SubmitToken submit(const vk::SubmitInfo &info,
+                     const std::vector<uint64_t> &wait_values = {},
+                     vk::Fence fence = vk::Fence()) {
+    return submit(std::vector<vk::SubmitInfo>{info}, {SubmitValues{wait_values, {}}}, fence);
+  }
+
+  // Submit several batches with one vkQueueSubmit. They are ordered as
+  // given and the returned timeline value is signaled after the last one.
+  SubmitToken submit(const std::vector<vk::SubmitInfo> &batches,
+                     const std::vector<SubmitValues> &values,
+                     vk::Fence fence = vk::Fence()) {
+    std::vector<vk::SubmitInfo> infos = batches;
+    if (infos.empty())
+      infos.emplace_back();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    SubmitToken value = submitted + 1;
+    vk::Result result;
+    if (semaphore) {
+      size_t count = infos.size();
+      std::vector<std::vector<uint64_t>> waits(count), signal_values(count);
+      std::vector<vk::TimelineSemaphoreSubmitInfo> timeline_infos(count);
+      std::vector<vk::Semaphore> last_signals(infos.back().pSignalSemaphores,
+                                              infos.back().pSignalSemaphores + infos.back().signalSemaphoreCount);
+      last_signals.push_back(semaphore);
+      for (size_t i = 0; i < count; ++i) {
+        auto &info = infos[i];
+        waits[i].assign(info.waitSemaphoreCount, 0);
+        signal_values[i].assign(info.signalSemaphoreCount, 0);
+        if (i < values.size()) {
+          auto &given = values[i];
+          std::copy_n(given.waits.begin(), std::min(given.waits.size(), waits[i].size()), waits[i].begin());
+          std::copy_n(given.signals.begin(), std::min(given.signals.size(), signal_values[i].size()),
+                      signal_values[i].begin());
+        }
+        if (i + 1 == count) {
+          signal_values[i].push_back(value);
+          info.signalSemaphoreCount = static_cast<uint32_t>(last_signals.size());
+          info.pSignalSemaphores = last_signals.data();
+        }
+
+        auto &timeline_info = timeline_infos[i];
+        timeline_info.pNext = info.pNext;
+        timeline_info.waitSemaphoreValueCount = static_cast<uint32_t>(waits[i].size());
+        timeline_info.pWaitSemaphoreValues = waits[i].data();
+        timeline_info.signalSemaphoreValueCount = static_cast<uint32_t>(signal_values[i].size());
+        timeline_info.pSignalSemaphoreValues = signal_values[i].data();
+        info.pNext = &timeline_info;
+      }
+      result = queue.submit(static_cast<uint32_t>(count), infos.data(), fence, dispatch());
+    } else {
+      collect();
+      vk::Fence tracking = acquire_fence();
+      result = queue.submit(static_cast<uint32_t>(infos.size()), infos.data(), tracking, dispatch());
+      if (result != vk::Result::eSuccess) {
+        free_fences.push_back(tracking);
+      } else {
+        pending.push_back({value, tracking});
+        if (fence)
+          result = queue.submit(0, nullptr, fence, dispatch());
+      }
     }
-    return index;
-  }
-  vk::Queue getQueue(uint32_t family, uint32_t queueIndex = 0) const {
-    return instance.getQueue(family, queueIndex);
+    if (result != vk::Result::eSuccess)
+      throw std::runtime_error("failed_queue_submit");
+    submitted = value;
+    return value;
+  }
+
+  // Present on this queue, serialized with the submissions.
+  vk::Result present(const vk::PresentInfoKHR &info) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.presentKHR(&info, dispatch());
+  }
+
+  // The highest value the GPU has finished.
+  SubmitToken completedValue() {
+    if (semaphore) {
+      uint64_t value = 0;
+      if (device.getSemaphoreCounterValue(semaphore, &value, dispatch()) != vk::Result::eSuccess)
+        throw std::runtime_error("failed_get_semaphore_counter_value");
+      update_completed(value);
+      return value;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    collect();
+    return completed;
   }
 
-  // This function will return a empty Queue if the type is invalid.
-  vk::Queue getQueue(QueueType type, uint32_t queueIndex = 0) const {
-    uint32_t family_index = get_queue_index(type);
-    if (family_index == QUEUE_INDEX_MAX_VALUE)
-      return vk::Queue();
-    return getQueue(family_index, queueIndex);
+  bool isComplete(SubmitToken value) {
+    return value <= completed.load() || value <= completedValue();
   }
-  // Only a compute or transfer queue type is valid. All other queue types do
-  // not support a 'dedicated' queue
-  vk::Queue get_dedicated_queue(QueueType type, uint32_t queueIndex = 0) const {
-    uint32_t family_index = get_dedicated_queue_index(type);
-    if (family_index == QUEUE_INDEX_MAX_VALUE)
-      return vk::Queue();
-    return getQueue(family_index, queueIndex);
+
+  // Block until `value` is reached. Returns false on timeout. Throws for a
+  // value that was never submitted, nothing would ever signal it.
+  bool waitFor(SubmitToken value, uint64_t timeout = UINT64_MAX) {
+    if (value <= completed.load())
+      return true;
+    if (value > submittedValue())
+      throw std::runtime_error("value_not_submitted");
+    if (semaphore) {
+      vk::SemaphoreWaitInfo wait_info;
+      wait_info.semaphoreCount = 1;
+      wait_info.pSemaphores = &semaphore;
+      wait_info.pValues = &value;
+      vk::Result result = device.waitSemaphores(&wait_info, timeout, dispatch());
+      if (result == vk::Result::eTimeout)
+        return false;
+      if (result != vk::Result::eSuccess)
+        throw std::runtime_error("failed_wait_semaphores");
+      update_completed(value);
+      return true;
+    }
+    // The fence is waited on without the lock so submissions are not held
+    // up. While anyone waits, collect() does not recycle signaled fences.
+    vk::Fence fence;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      collect();
+      if (value <= completed.load())
+        return true;
+      for (auto &entry : pending) {
+        if (entry.value >= value) {
+          fence = entry.fence;
+          break;
+        }
+      }
+      if (!fence)
+        return false;
+      fence_waiters++;
+    }
+    vk::Result result = device.waitForFences(1, &fence, true, timeout, dispatch());
+    std::lock_guard<std::mutex> lock(mutex);
+    fence_waiters--;
+    collect();
+    if (result == vk::Result::eTimeout)
+      return false;
+    return value <= completed.load();
+  }
+
+  void waitIdle() { waitFor(submittedValue()); }
+
+  // A wait for `value` that a submission on another queue can use. Without
+  // timeline semaphores this blocks until `value` is reached and returns an
+  // empty wait.
+  TimelineWait waitInfo(SubmitToken value,
+                        vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eAllCommands) {
+    if (value == 0)
+      return TimelineWait{};
+    if (!semaphore) {
+      if (!waitFor(value))
+        throw std::runtime_error("failed_wait_timeline");
+      return TimelineWait{};
+    }
+    if (value > submittedValue())
+      throw std::runtime_error("value_not_submitted");
+    return TimelineWait{semaphore, value, stage};
   }
 
-  vk::CommandPool createCommandPool(QueueType qt = QueueType::graphics) {
-    vk::CommandPoolCreateInfo pool_info = {};
-    pool_info.queueFamilyIndex = get_queue_index(qt);
-    pool_info.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
-    return instance.createCommandPool(pool_info, allocation_callbacks);
+  SubmitToken submittedValue() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return submitted;
   }
 
-  std::vector<vk::CommandBuffer> createCommandBuffers(vk::CommandPool pool, uint32_t count = 1) {
-    vk::CommandBufferAllocateInfo allocInfo = {};
-    allocInfo.commandPool                 = pool;
-    allocInfo.level                       = vk::CommandBufferLevel::ePrimary;
-    allocInfo.commandBufferCount          = count;
+  // Null when timeline semaphores are not in use.
+  vk::Semaphore get_semaphore() const { return semaphore; }
+  bool isTimelineSemaphore() const { return bool(semaphore); }
+  uint32_t get_queue_family() const { return queue_family; }
+  vk::Queue get_queue() const { return queue; }
 
-    return instance.allocateCommandBuffers(allocInfo);
+  const vk::DispatchLoaderDynamic &dispatch() const {
+    return dispatch_table ? *dispatch_table : VULKAN_HPP_DEFAULT_DISPATCHER;
   }
 
-  vk::Semaphore createSemaphore() {
-    vk::SemaphoreCreateInfo semaphore_info = {};
-    return instance.createSemaphore(semaphore_info);
+  void destroy() {
+    if (!device)
+      return;
+    waitIdle();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (semaphore)
+      device.destroySemaphore(semaphore, allocation_callbacks, dispatch());
+    for (auto &entry : pending)
+      device.destroyFence(entry.fence, allocation_callbacks, dispatch());
+    for (auto fence : free_fences)
+      device.destroyFence(fence, allocation_callbacks, dispatch());
+    for (auto fence : signaled_fences)
+      device.destroyFence(fence, allocation_callbacks, dispatch());
+    pending.clear();
+    free_fences.clear();
+    signaled_fences.clear();
+    semaphore = vk::Semaphore();
+    device = vk::Device();
   }
 
-  std::vector<vk::Semaphore> createSemaphores(uint32_t count) {
-    std::vector<vk::Semaphore> semaphores(count);
-    for (uint32_t i = 0; i < count; ++i) {
-      semaphores[i] = createSemaphore();
-    }
-    return semaphores;
-  }
+private:
+  struct Pending {
+    SubmitToken value;
+    vk::Fence fence;
+  };
 
-  vk::Fence createFence() {
-    vk::FenceCreateInfo fence_info = {};
-    fence_info.flags = vk::FenceCreateFlagBits::eSignaled;
-    return instance.createFence(fence_info);
+  void update_completed(SubmitToken value) {
+    SubmitToken current = completed.load();
+    while (current < value && !completed.compare_exchange_weak(current, value)) {
+    }
   }
 
-  std::vector<vk::Fence> createFences(uint32_t count) {
-    std::vector<vk::Fence> fences(count);
-    for (uint32_t i = 0; i < count; ++i) {
-      fences[i] = createFence();
+  vk::Fence acquire_fence() {
+    if (!free_fences.empty()) {
+      vk::Fence fence = free_fences.back();
+      free_fences.pop_back();
+      return fence;
+    }
+    return device.createFence(vk::FenceCreateInfo{}, allocation_callbacks, dispatch());
+  }
+
+  // Fallback mode only: retire every signaled fence at the front. They are
+  // reset and reused once no thread waits on a fence any more.
+  void collect() {
+    while (!pending.empty() &&
+           device.getFenceStatus(pending.front().fence, dispatch()) == vk::Result::eSuccess) {
+      Pending entry = pending.front();
+      pending.pop_front();
+      signaled_fences.push_back(entry.fence);
+      update_completed(entry.value);
+    }
+    if (fence_waiters == 0 && !signaled_fences.empty()) {
+      device.resetFences(static_cast<uint32_t>(signaled_fences.size()), signaled_fences.data(), dispatch());
+      free_fences.insert(free_fences.end(), signaled_fences.begin(), signaled_fences.end());
+      signaled_fences.clear();
     }
-    return fences;
   }
-  
-  void destroy() { instance.destroy(allocation_callbacks); }
-};
 
-// For advanced device queue setup
-struct CustomQueueDescription {
-  explicit CustomQueueDescription(uint32_t index, uint32_t count,
-                                  std::vector<float> priorities)
-      : index(index), count(count), priorities(priorities) {
-    assert(count == priorities.size());
-  }
-  uint32_t index = 0;
-  uint32_t count = 0;
-  std::vector<float> priorities;
+  vk::Device device;
+  uint32_t queue_family;
+  vk::Queue queue;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table;
+  vk::Semaphore semaphore;
+
+  mutable std::mutex mutex;
+  SubmitToken submitted = 0;
+  std::atomic<SubmitToken> completed{0};
+  std::deque<Pending> pending;
+  std::vector<vk::Fence> free_fences;
+  std::vector<vk::Fence> signaled_fences;
+  uint32_t fence_waiters = 0;
 };
 
-class DeviceBuilder {
+// Every queue the device was created with, as QueueTimelines indexed by
+// (family, index). Threads that record and submit in parallel get their own
+// queue where the family has enough of them, either round-robin with
+// acquire() or with a stable per-thread assignment from acquireForThread().
+// Threads sharing a queue are serialized by its QueueTimeline.
+class QueueManager {
 public:
-  // Any features and extensions that are requested/required in
-  // PhysicalDeviceSelector are automatically enabled.
-  DeviceBuilder(PhysicalDevice phys_device) {
-    info.physical_device = phys_device;
-    info.surface = phys_device.surface;
-    info.queue_families = phys_device.queue_families;
-    info.features = phys_device.features;
-    info.extensions_to_enable = phys_device.extensions_to_enable;
-    info.defer_surface_initialization =
-        phys_device.defer_surface_initialization;
+  QueueManager() {}
+  explicit QueueManager(std::vector<std::vector<std::shared_ptr<QueueTimeline>>> queues)
+      : families(queues.size()) {
+    for (size_t i = 0; i < queues.size(); ++i)
+      families[i].queues = std::move(queues[i]);
   }
 
-  // For Advanced Users: specify the exact list of VkDeviceQueueCreateInfo's
-  // needed for the application. If a custom queue setup is provided, getting
-  // the queues and queue indexes is up to the application.
-  DeviceBuilder &
-  custom_queue_setup(std::vector<CustomQueueDescription> queue_descriptions) {
-    info.queue_descriptions = queue_descriptions;
-    return *this;
+  QueueManager(const QueueManager &) = delete;
+  QueueManager &operator=(const QueueManager &) = delete;
+
+  uint32_t queueCount(uint32_t family) const {
+    return family < families.size() ? static_cast<uint32_t>(families[family].queues.size()) : 0;
   }
 
-  // Add a structure to the pNext chain of VkDeviceCreateInfo.
-  // The structure must be valid when DeviceBuilder::build() is called.
-  template <typename T> DeviceBuilder &add_pNext(T *structure) {
-    info.pNext_chain.push_back(
-        reinterpret_cast<vk::BaseOutStructure *>(structure));
-    return *this;
+  const std::shared_ptr<QueueTimeline> &get(uint32_t family, uint32_t index = 0) const {
+    if (index >= queueCount(family))
+      throw std::runtime_error("no_queue_in_family");
+    return families[family].queues[index];
   }
 
-  // Provide custom allocation callbacks.
-  DeviceBuilder &set_allocation_callbacks(vk::Optional<const vk::AllocationCallbacks> callbacks) {
-    info.allocation_callbacks = callbacks;
-    return *this;
+  // The next queue of `family`, round-robin.
+  const std::shared_ptr<QueueTimeline> &acquire(uint32_t family) {
+    uint32_t count = queueCount(family);
+    if (count == 0)
+      throw std::runtime_error("no_queue_in_family");
+    return families[family].queues[families[family].next.fetch_add(1) % count];
   }
 
-  Device build() const {
+  // The queue of `family` assigned to the calling thread. Threads are
+  // assigned round-robin on first use and keep their queue afterwards.
+  const std::shared_ptr<QueueTimeline> &acquireForThread(uint32_t family) {
+    uint32_t count = queueCount(family);
+    if (count == 0)
+      throw std::runtime_error("no_queue_in_family");
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &affinity = families[family].affinity;
+    auto id = std::this_thread::get_id();
+    auto it = affinity.find(id);
+    if (it == affinity.end())
+      it = affinity.emplace(id, families[family].next.fetch_add(1) % count).first;
+    return families[family].queues[it->second];
+  }
 
-    std::vector<CustomQueueDescription> queue_descriptions;
-    queue_descriptions.insert(queue_descriptions.end(),
-                              info.queue_descriptions.begin(),
-                              info.queue_descriptions.end());
+  // Every queue, in (family, index) order.
+  std::vector<std::shared_ptr<QueueTimeline>> all() const {
+    std::vector<std::shared_ptr<QueueTimeline>> result;
+    for (auto &family : families)
+      result.insert(result.end(), family.queues.begin(), family.queues.end());
+    return result;
+  }
 
-    if (queue_descriptions.size() == 0) {
-      for (uint32_t i = 0; i < info.queue_families.families.size(); i++) {
-        queue_descriptions.push_back(
-            CustomQueueDescription{i, 1, std::vector<float>{1.0f}});
-      }
-    }
+  void destroy() {
+    for (auto &family : families)
+      for (auto &queue : family.queues)
+        queue->destroy();
+  }
 
-    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
-    for (auto &desc : queue_descriptions) {
-      vk::DeviceQueueCreateInfo queue_create_info = {};
-      queue_create_info.queueFamilyIndex = desc.index;
-      queue_create_info.queueCount = desc.count;
-      queue_create_info.pQueuePriorities = desc.priorities.data();
-      queueCreateInfos.push_back(queue_create_info);
-    }
+private:
+  struct Family {
+    std::vector<std::shared_ptr<QueueTimeline>> queues;
+    std::atomic<uint32_t> next{0};
+    std::map<std::thread::id, uint32_t> affinity;
+
+    Family() {}
+    Family(Family &&other) : queues(std::move(other.queues)), next(other.next.load()),
+                             affinity(std::move(other.affinity)) {}
+  };
 
-    std::vector<const char *> extensions =
-        helper::strvec2c_str(info.extensions_to_enable);
-    if (info.surface || info.defer_surface_initialization)
-      extensions.push_back({VK_KHR_SWAPCHAIN_EXTENSION_NAME});
+  std::vector<Family> families;
+  std::mutex mutex;
+};
 
-    // VUID-VkDeviceCreateInfo-pNext-00373 - don't add pEnabledFeatures if the
-    // phys_dev_features_2 is present
-    bool has_phys_dev_features_2 = false;
-    for (auto &pNext_struct : info.pNext_chain) {
-      if (pNext_struct->sType == vk::StructureType::ePhysicalDeviceFeatures2) {
-        has_phys_dev_features_2 = true;
-      }
+// Submits short lived work (uploads, layout changes) to one queue without
+// draining the device. Command buffers are recycled once the queue's
+// timeline passes their submission, and submit() returns that timeline
+// value so callers can overlap many submissions and wait only on the ones
+// they need.
+class ImmediateContext {
+public:
+  ImmediateContext(vk::Device device, std::shared_ptr<QueueTimeline> timeline,
+                   vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), timeline(std::move(timeline)),
+        allocation_callbacks(allocation_callbacks) {
+    vk::CommandPoolCreateInfo pool_info = {};
+    pool_info.queueFamilyIndex = this->timeline->get_queue_family();
+    pool_info.flags = vk::CommandPoolCreateFlagBits::eTransient |
+                      vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    command_pool = device.createCommandPool(pool_info, allocation_callbacks);
+  }
+
+  ImmediateContext(const ImmediateContext &) = delete;
+  ImmediateContext &operator=(const ImmediateContext &) = delete;
+  ~ImmediateContext() { destroy(); }
+
+  // Record `func` into a recycled command buffer and submit it after the
+  // given waits.
+  SubmitToken submit(const std::function<void(vk::CommandBuffer cb)> &func,
+                     const std::vector<TimelineWait> &waits = {}) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collect();
+    Slot slot = acquire_slot();
+    try {
+      slot.cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit}, dispatch());
+      func(slot.cb);
+      slot.cb.end(dispatch());
+    } catch (...) {
+      slot.cb.reset(vk::CommandBufferResetFlags{}, dispatch());
+      free_slots.push_back(slot);
+      throw;
     }
 
-    vk::DeviceCreateInfo device_create_info = {};
-    helper::setup_pNext_chain<vk::DeviceCreateInfo>(device_create_info,
-                                                    info.pNext_chain);
-    device_create_info.flags = info.flags;
-    device_create_info.queueCreateInfoCount =
-        static_cast<uint32_t>(queueCreateInfos.size());
-    device_create_info.pQueueCreateInfos = queueCreateInfos.data();
-    device_create_info.enabledExtensionCount =
-        static_cast<uint32_t>(extensions.size());
-    device_create_info.ppEnabledExtensionNames = extensions.data();
-    if (!has_phys_dev_features_2) {
-      device_create_info.pEnabledFeatures = &info.features;
+    std::vector<vk::Semaphore> wait_semaphores;
+    std::vector<vk::PipelineStageFlags> wait_stages;
+    std::vector<uint64_t> wait_values;
+    for (auto &wait : waits) {
+      if (!wait)
+        continue;
+      wait_semaphores.push_back(wait.semaphore);
+      wait_stages.push_back(wait.stage);
+      wait_values.push_back(wait.value);
     }
-    Device device;
-    auto vkdev = info.physical_device->createDevice(
-        device_create_info, info.allocation_callbacks);
-    if (!vkdev) {
-      throw std::runtime_error("Device create failed");
-    }
-    device.instance = vkdev;
-    device.physical_device = info.physical_device;
-    device.surface = info.surface;
-    device.queue_families = info.queue_families;
-    device.allocation_callbacks = info.allocation_callbacks;
-    return device;
+
+    vk::SubmitInfo submit_info;
+    submit_info.waitSemaphoreCount = static_cast<uint32_t>(wait_semaphores.size());
+    submit_info.pWaitSemaphores = wait_semaphores.data();
+    submit_info.pWaitDstStageMask = wait_stages.data();
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &slot.cb;
+    slot.token = timeline->submit(submit_info, wait_values);
+
+    last_submitted = slot.token;
+    in_flight.push_back(slot);
+    return slot.token;
   }
 
-private:
-  struct DeviceInfo {
+  // Returns true once the GPU has finished the submission behind `token`.
+  bool isComplete(SubmitToken token) { return timeline->isComplete(token); }
+
+  // Block until the submission behind `token` has finished.
+  void wait(SubmitToken token) { timeline->waitFor(token); }
+
+  void waitAll() { wait(lastSubmitted()); }
+
+  SubmitToken lastSubmitted() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return last_submitted;
+  }
+
+  uint32_t get_queue_family() const { return timeline->get_queue_family(); }
+  vk::Queue get_queue() const { return timeline->get_queue(); }
+  const std::shared_ptr<QueueTimeline> &get_timeline() const { return timeline; }
+
+  const vk::DispatchLoaderDynamic &dispatch() const { return timeline->dispatch(); }
+
+  void destroy() {
+    // Wait without the lock, other threads may still be submitting.
+    timeline->waitFor(lastSubmitted());
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!command_pool)
+      return;
+    timeline->waitFor(last_submitted);
+    in_flight.clear();
+    free_slots.clear();
+    device.destroyCommandPool(command_pool, allocation_callbacks);
+    command_pool = vk::CommandPool();
+  }
+
+private:
+  struct Slot {
+    vk::CommandBuffer cb;
+    SubmitToken token = 0;
+  };
+
+  Slot acquire_slot() {
+    if (!free_slots.empty()) {
+      Slot slot = free_slots.back();
+      free_slots.pop_back();
+      return slot;
+    }
+    vk::CommandBufferAllocateInfo cbai{command_pool, vk::CommandBufferLevel::ePrimary, 1};
+    Slot slot;
+    slot.cb = device.allocateCommandBuffers(cbai)[0];
+    return slot;
+  }
+
+  // Recycle every finished submission at the front of the queue.
+  void collect() {
+    if (in_flight.empty())
+      return;
+    SubmitToken done = timeline->completedValue();
+    while (!in_flight.empty() && in_flight.front().token <= done) {
+      free_slots.push_back(in_flight.front());
+      in_flight.pop_front();
+    }
+  }
+
+  vk::Device device;
+  std::shared_ptr<QueueTimeline> timeline;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  vk::CommandPool command_pool;
+
+  mutable std::mutex mutex;
+  std::deque<Slot> in_flight;
+  std::vector<Slot> free_slots;
+  SubmitToken last_submitted = 0;
+};
+
+// Transient command pools for per-frame recording, one pool per thread per
+// frame slot. beginFrame() resets all pools of a slot at once, after the
+// timeline value of the frame that last used them has completed, and their
+// command buffers are handed out again instead of being reallocated. No
+// pool is created with eResetCommandBuffer.
+//
+// Any thread may allocate() between beginFrame() and endFrame(), each one
+// records from its own pool. beginFrame() and endFrame() must not run
+// concurrently with allocate().
+class CommandPoolManager {
+public:
+  CommandPoolManager(vk::Device device, std::shared_ptr<QueueTimeline> timeline,
+                     uint32_t frame_slots,
+                     vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), timeline(std::move(timeline)),
+        allocation_callbacks(allocation_callbacks),
+        slot_values(std::max(frame_slots, 1u), 0) {}
+
+  CommandPoolManager(const CommandPoolManager &) = delete;
+  CommandPoolManager &operator=(const CommandPoolManager &) = delete;
+  ~CommandPoolManager() { destroy(); }
+
+  // Make `slot` current. Waits for the last frame submitted from it, then
+  // resets every pool of the slot.
+  void beginFrame(uint32_t slot) {
+    if (slot >= slot_values.size())
+      throw std::runtime_error("invalid_frame_slot");
+    timeline->waitFor(slot_values[slot]);
+    std::lock_guard<std::mutex> lock(mutex);
+    current = slot;
+    for (auto &thread : threads) {
+      Pool &pool = thread.second[slot];
+      if (pool.used_primary == 0 && pool.used_secondary == 0)
+        continue;
+      device.resetCommandPool(pool.pool, vk::CommandPoolResetFlags{}, dispatch());
+      pool.used_primary = 0;
+      pool.used_secondary = 0;
+    }
+  }
+
+  // A command buffer from the calling thread's pool of the current slot,
+  // valid until the slot comes around again.
+  vk::CommandBuffer allocate(vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary) {
+    Pool &pool = thread_pool();
+    bool primary = level == vk::CommandBufferLevel::ePrimary;
+    auto &buffers = primary ? pool.primary : pool.secondary;
+    size_t &used = primary ? pool.used_primary : pool.used_secondary;
+    if (used == buffers.size()) {
+      vk::CommandBufferAllocateInfo info{pool.pool, level, 1};
+      vk::CommandBuffer cb;
+      if (device.allocateCommandBuffers(&info, &cb, dispatch()) != vk::Result::eSuccess)
+        throw std::runtime_error("failed_allocate_command_buffers");
+      buffers.push_back(cb);
+    }
+    return buffers[used++];
+  }
+
+  // The timeline value of the submission that consumes the current slot's
+  // command buffers.
+  void endFrame(SubmitToken value) {
+    slot_values[current] = value;
+  }
+
+  uint32_t get_current_slot() const { return current; }
+  uint32_t get_frame_slots() const { return static_cast<uint32_t>(slot_values.size()); }
+  uint32_t get_queue_family() const { return timeline->get_queue_family(); }
+
+  const vk::DispatchLoaderDynamic &dispatch() const { return timeline->dispatch(); }
+
+  void destroy() {
+    if (!device)
+      return;
+    for (auto value : slot_values)
+      timeline->waitFor(value);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &thread : threads)
+      for (auto &pool : thread.second)
+        if (pool.pool)
+          device.destroyCommandPool(pool.pool, allocation_callbacks, dispatch());
+    threads.clear();
+    device = vk::Device();
+  }
+
+private:
+  struct Pool {
+    vk::CommandPool pool;
+    std::vector<vk::CommandBuffer> primary;
+    std::vector<vk::CommandBuffer> secondary;
+    size_t used_primary = 0;
+    size_t used_secondary = 0;
+  };
+
+  Pool &thread_pool() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &pools = threads[std::this_thread::get_id()];
+    if (pools.empty())
+      pools.resize(slot_values.size());
+    Pool &pool = pools[current];
+    if (!pool.pool) {
+      vk::CommandPoolCreateInfo pool_info = {};
+      pool_info.queueFamilyIndex = timeline->get_queue_family();
+      pool_info.flags = vk::CommandPoolCreateFlagBits::eTransient;
+      pool.pool = device.createCommandPool(pool_info, allocation_callbacks, dispatch());
+    }
+    return pool;
+  }
+
+  vk::Device device;
+  std::shared_ptr<QueueTimeline> timeline;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+
+  std::mutex mutex;
+  std::vector<SubmitToken> slot_values;
+  uint32_t current = 0;
+  // Per thread, indexed by frame slot. std::map keeps the pools in place
+  // while other threads add theirs.
+  std::map<std::thread::id, std::vector<Pool>> threads;
+};
+
+// What a cached command buffer was recorded from: the handles it binds
+// (pipelines, buffers, descriptor sets), the extent baked into viewport and
+// scissor, and versions of any other recorded values (draw counts, push
+// constants). Bump a version when such a value changes. Buffer and image
+// contents are read when the commands execute and need no entry.
+class CommandDependencies {
+public:
+  template <class T>
+  CommandDependencies& add(T handle) {
+    key.push_back((uint64_t)static_cast<typename T::CType>(handle));
+    return *this;
+  }
+
+  CommandDependencies& addVersion(uint64_t version) {
+    key.push_back(version);
+    return *this;
+  }
+
+  CommandDependencies& addExtent(vk::Extent2D extent) {
+    key.push_back((uint64_t(extent.width) << 32) | extent.height);
+    return *this;
+  }
+
+  bool operator==(const CommandDependencies &other) const { return key == other.key; }
+  bool operator!=(const CommandDependencies &other) const { return key != other.key; }
+
+private:
+  std::vector<uint64_t> key;
+};
+
+// Secondary command buffers that are recorded once and replayed every
+// frame. get() records one the first time an id is asked for and again
+// only when its dependencies changed, so static geometry costs nothing to
+// record. They are recorded with eSimultaneousUse, frames in flight can
+// all execute the same one. A replaced command buffer is reused once the
+// frame submitted after the replacement, see endFrame(), has completed.
+class CommandCache {
+public:
+  CommandCache(vk::Device device, std::shared_ptr<QueueTimeline> timeline,
+               vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), timeline(std::move(timeline)),
+        allocation_callbacks(allocation_callbacks) {
+    // Recording is rare here, individual resets are fine.
+    vk::CommandPoolCreateInfo pool_info = {};
+    pool_info.queueFamilyIndex = this->timeline->get_queue_family();
+    pool_info.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    command_pool = device.createCommandPool(pool_info, allocation_callbacks, dispatch());
+  }
+
+  CommandCache(const CommandCache &) = delete;
+  CommandCache &operator=(const CommandCache &) = delete;
+  ~CommandCache() { destroy(); }
+
+  // The command buffer cached under `id`, recorded by `func` if there is
+  // none yet or if it was recorded with other dependencies or inheritance.
+  vk::CommandBuffer get(uint64_t id, const CommandDependencies &dependencies,
+                        const vk::CommandBufferInheritanceInfo &inheritance,
+                        const std::function<void(vk::CommandBuffer cb)> &func) {
+    CommandDependencies key = dependencies;
+    key.add(inheritance.renderPass).add(inheritance.framebuffer).addVersion(inheritance.subpass);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    collect();
+    auto it = entries.find(id);
+    if (it != entries.end()) {
+      if (it->second.dependencies == key) {
+        hits++;
+        return it->second.cb;
+      }
+      unfenced.push_back(it->second.cb);
+      entries.erase(it);
+    }
+
+    vk::CommandBuffer cb = acquire();
+    vk::CommandBufferUsageFlags usage = vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+    if (inheritance.renderPass)
+      usage |= vk::CommandBufferUsageFlagBits::eRenderPassContinue;
+    try {
+      cb.begin(vk::CommandBufferBeginInfo{usage, &inheritance}, dispatch());
+      func(cb);
+      cb.end(dispatch());
+    } catch (...) {
+      cb.reset(vk::CommandBufferResetFlags{}, dispatch());
+      free_buffers.push_back(cb);
+      throw;
+    }
+    entries[id] = Entry{key, cb};
+    records++;
+    return cb;
+  }
+
+  // Drop the command buffer of `id`, the next get() records it again.
+  void invalidate(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(id);
+    if (it == entries.end())
+      return;
+    unfenced.push_back(it->second.cb);
+    entries.erase(it);
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : entries)
+      unfenced.push_back(entry.second.cb);
+    entries.clear();
+  }
+
+  // The timeline value of the first submission made after the command
+  // buffers replaced since the last call were last executed.
+  void endFrame(SubmitToken value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto cb : unfenced)
+      retired.push_back({cb, value});
+    unfenced.clear();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+  }
+
+  // Totals: command buffers recorded, and get() calls served from the
+  // cache.
+  size_t recordCount() const { return records; }
+  size_t hitCount() const { return hits; }
+
+  const vk::DispatchLoaderDynamic &dispatch() const { return timeline->dispatch(); }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!command_pool)
+      return;
+    timeline->waitIdle();
+    entries.clear();
+    unfenced.clear();
+    retired.clear();
+    free_buffers.clear();
+    device.destroyCommandPool(command_pool, allocation_callbacks, dispatch());
+    command_pool = vk::CommandPool();
+  }
+
+private:
+  struct Entry {
+    CommandDependencies dependencies;
+    vk::CommandBuffer cb;
+  };
+
+  struct Retired {
+    vk::CommandBuffer cb;
+    SubmitToken value;
+  };
+
+  vk::CommandBuffer acquire() {
+    if (!free_buffers.empty()) {
+      vk::CommandBuffer cb = free_buffers.back();
+      free_buffers.pop_back();
+      return cb;
+    }
+    vk::CommandBufferAllocateInfo info{command_pool, vk::CommandBufferLevel::eSecondary, 1};
+    vk::CommandBuffer cb;
+    if (device.allocateCommandBuffers(&info, &cb, dispatch()) != vk::Result::eSuccess)
+      throw std::runtime_error("failed_allocate_command_buffers");
+    return cb;
+  }
+
+  void collect() {
+    if (retired.empty())
+      return;
+    SubmitToken done = timeline->completedValue();
+    while (!retired.empty() && retired.front().value <= done) {
+      retired.front().cb.reset(vk::CommandBufferResetFlags{}, dispatch());
+      free_buffers.push_back(retired.front().cb);
+      retired.pop_front();
+    }
+  }
+
+  vk::Device device;
+  std::shared_ptr<QueueTimeline> timeline;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  vk::CommandPool command_pool;
+
+  mutable std::mutex mutex;
+  std::unordered_map<uint64_t, Entry> entries;
+  std::vector<vk::CommandBuffer> unfenced;
+  std::deque<Retired> retired;
+  std::vector<vk::CommandBuffer> free_buffers;
+  std::atomic<size_t> records{0};
+  std::atomic<size_t> hits{0};
+};
+
+// Collects the command buffers of a frame for one queue (uploads, compute,
+// passes) together with their semaphore waits and signals, and submits them
+// with a single vkQueueSubmit in flush(). Order is preserved: command
+// buffers run in the order they were added. A new batch (vk::SubmitInfo)
+// is only started when an added group waits on something and the current
+// batch already has work, so earlier work is not held back by the wait, or
+// when the current batch signals something, so the signal is not delayed
+// by later work.
+class SubmitBatcher {
+public:
+  // A semaphore to signal. `value` is for timeline semaphores, 0 for a
+  // binary one.
+  struct Signal {
+    vk::Semaphore semaphore;
+    uint64_t value = 0;
+  };
+
+  explicit SubmitBatcher(std::shared_ptr<QueueTimeline> timeline)
+      : timeline(std::move(timeline)) {}
+
+  SubmitBatcher(const SubmitBatcher &) = delete;
+  SubmitBatcher &operator=(const SubmitBatcher &) = delete;
+
+  // Queue `cbs` after everything added so far. They start once `waits` are
+  // satisfied, `signals` are signaled once they completed.
+  void add(const std::vector<vk::CommandBuffer> &cbs,
+           const std::vector<TimelineWait> &waits = {},
+           const std::vector<Signal> &signals = {}) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool has_waits = std::any_of(waits.begin(), waits.end(),
+                                 [](const TimelineWait &wait) { return bool(wait); });
+    if (batches.empty() || !batches.back().signals.empty() ||
+        (has_waits && !batches.back().cbs.empty()))
+      batches.emplace_back();
+
+    Batch &batch = batches.back();
+    for (auto &wait : waits) {
+      if (!wait)
+        continue;
+      batch.waits.push_back(wait.semaphore);
+      batch.wait_stages.push_back(wait.stage);
+      batch.values.waits.push_back(wait.value);
+    }
+    batch.cbs.insert(batch.cbs.end(), cbs.begin(), cbs.end());
+    for (auto &signal : signals) {
+      batch.signals.push_back(signal.semaphore);
+      batch.values.signals.push_back(signal.value);
+    }
+    pending += cbs.size();
+  }
+
+  void add(vk::CommandBuffer cb, const std::vector<TimelineWait> &waits = {},
+           const std::vector<Signal> &signals = {}) {
+    add(std::vector<vk::CommandBuffer>{cb}, waits, signals);
+  }
+
+  // Make the first batch of the next flush() wait on `waits` as well, so
+  // nothing added before or after starts until they are satisfied.
+  void prependWaits(const std::vector<TimelineWait> &waits) {
+    if (std::none_of(waits.begin(), waits.end(), [](const TimelineWait &wait) { return bool(wait); }))
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (batches.empty())
+      batches.emplace_back();
+    Batch &batch = batches.front();
+    for (auto &wait : waits) {
+      if (!wait)
+        continue;
+      batch.waits.push_back(wait.semaphore);
+      batch.wait_stages.push_back(wait.stage);
+      batch.values.waits.push_back(wait.value);
+    }
+  }
+
+  // Submit everything added since the last flush. Returns the timeline
+  // value that completes all of it, 0 if nothing was added.
+  SubmitToken flush(vk::Fence fence = vk::Fence()) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (batches.empty())
+      return 0;
+
+    std::vector<vk::SubmitInfo> infos(batches.size());
+    std::vector<QueueTimeline::SubmitValues> values(batches.size());
+    for (size_t i = 0; i < batches.size(); ++i) {
+      Batch &batch = batches[i];
+      auto &info = infos[i];
+      info.waitSemaphoreCount = static_cast<uint32_t>(batch.waits.size());
+      info.pWaitSemaphores = batch.waits.data();
+      info.pWaitDstStageMask = batch.wait_stages.data();
+      info.commandBufferCount = static_cast<uint32_t>(batch.cbs.size());
+      info.pCommandBuffers = batch.cbs.data();
+      info.signalSemaphoreCount = static_cast<uint32_t>(batch.signals.size());
+      info.pSignalSemaphores = batch.signals.data();
+      values[i] = batch.values;
+    }
+
+    SubmitToken value;
+    try {
+      value = timeline->submit(infos, values, fence);
+    } catch (...) {
+      batches.clear();
+      pending = 0;
+      throw;
+    }
+    submit_count++;
+    batch_count += batches.size();
+    cb_count += pending;
+    batches.clear();
+    pending = 0;
+    return value;
+  }
+
+  // Command buffers waiting for flush().
+  size_t pendingCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending;
+  }
+
+  // Totals over every flush: vkQueueSubmit calls, batches and command
+  // buffers submitted.
+  size_t submitCount() const { return submit_count; }
+  size_t batchCount() const { return batch_count; }
+  size_t commandBufferCount() const { return cb_count; }
+
+  const std::shared_ptr<QueueTimeline> &get_timeline() const { return timeline; }
+
+private:
+  struct Batch {
+    std::vector<vk::Semaphore> waits;
+    std::vector<vk::PipelineStageFlags> wait_stages;
+    std::vector<vk::CommandBuffer> cbs;
+    std::vector<vk::Semaphore> signals;
+    QueueTimeline::SubmitValues values;
+  };
+
+  std::shared_ptr<QueueTimeline> timeline;
+
+  mutable std::mutex mutex;
+  std::vector<Batch> batches;
+  size_t pending = 0;
+  std::atomic<size_t> submit_count{0};
+  std::atomic<size_t> batch_count{0};
+  std::atomic<size_t> cb_count{0};
+};
+
+// Compute submissions on the dedicated or separate compute family, so that
+// simulation and culling dispatches overlap rasterization on the graphics
+// queue. Work is ordered against the graphics queue with timeline waits:
+// dispatch() can wait for a graphics value, graphicsWait() gives the wait a
+// graphics submission needs to consume the results. Without a separate
+// compute family the context runs on the graphics queue and submission
+// order applies.
+//
+// Resources written on one family and read on the other must be created
+// with vk::SharingMode::eConcurrent, or have their ownership transferred.
+class ComputeContext {
+public:
+  ComputeContext(vk::Device device, std::shared_ptr<QueueTimeline> compute,
+                 std::shared_ptr<QueueTimeline> graphics,
+                 vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : compute(compute), graphics(std::move(graphics)),
+        context(std::make_shared<ImmediateContext>(device, compute, allocation_callbacks)) {}
+
+  ComputeContext(const ComputeContext &) = delete;
+  ComputeContext &operator=(const ComputeContext &) = delete;
+
+  // True when dispatches run on their own queue, concurrently with
+  // graphics.
+  bool isAsync() const {
+    return compute->get_queue_family() != graphics->get_queue_family();
+  }
+
+  // Record `func` and submit it on the compute queue. With `after_graphics`
+  // the dispatch starts once the graphics timeline reached that value.
+  SubmitToken dispatch(const std::function<void(vk::CommandBuffer cb)> &func,
+                       SubmitToken after_graphics = 0) {
+    std::vector<TimelineWait> waits;
+    if (isAsync() && after_graphics)
+      waits.push_back(graphics->waitInfo(after_graphics, vk::PipelineStageFlagBits::eComputeShader));
+    return context->submit(func, waits);
+  }
+
+  // The wait a graphics submission needs to consume the results of the
+  // dispatch behind `value`, see Present::addWaitSemaphore.
+  TimelineWait graphicsWait(SubmitToken value,
+                            vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eDrawIndirect |
+                                                           vk::PipelineStageFlagBits::eVertexInput |
+                                                           vk::PipelineStageFlagBits::eVertexShader) {
+    if (!isAsync())
+      return TimelineWait{};
+    return compute->waitInfo(value, stage);
+  }
+
+  bool isComplete(SubmitToken value) { return compute->isComplete(value); }
+  void wait(SubmitToken value) { compute->waitFor(value); }
+
+  uint32_t get_queue_family() const { return compute->get_queue_family(); }
+  const std::shared_ptr<QueueTimeline> &get_timeline() const { return compute; }
+  const std::shared_ptr<ImmediateContext> &get_context() const { return context; }
+
+  void destroy() { context->destroy(); }
+
+private:
+  std::shared_ptr<QueueTimeline> compute;
+  std::shared_ptr<QueueTimeline> graphics;
+  std::shared_ptr<ImmediateContext> context;
+};
+
+// Device-owned queue of deferred destructions. A handle retired here waits
+// until endFrame(), which tags it with the submitted value of every queue
+// timeline, and is destroyed by collect() once all of them have completed
+// that value. A handle retired while a frame is being recorded therefore
+// outlives that frame's submission even if the GPU was idle at the retire.
+// Resources can then be released while frames are in flight without
+// waitIdle. Present::drawFrame calls endFrame() after submitting, without
+// Present call it after each frame's last submission.
+class DeletionQueue {
+public:
+  DeletionQueue(vk::Device device, std::vector<std::shared_ptr<QueueTimeline>> timelines,
+                vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr,
+                std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table = nullptr)
+      : device(device), timelines(std::move(timelines)),
+        allocation_callbacks(allocation_callbacks),
+        dispatch_table(std::move(dispatch_table)) {}
+
+  DeletionQueue(const DeletionQueue &) = delete;
+  DeletionQueue &operator=(const DeletionQueue &) = delete;
+  ~DeletionQueue() { destroy(); }
+
+  // Run `destroyer` once the GPU work submitted up to the next endFrame()
+  // has completed.
+  void retire(std::function<void()> destroyer) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      open.push_back(std::move(destroyer));
+    }
+    collect();
+  }
+
+  // Any handle vk::Device::destroy accepts (buffers, images, views,
+  // framebuffers, pipelines, semaphores, swapchains...).
+  template <class T, typename std::enable_if<
+                         !std::is_convertible<T, std::function<void()>>::value, int>::type = 0>
+  void retire(T handle) {
+    if (!handle)
+      return;
+    vk::Device dev = device;
+    auto callbacks = allocation_callbacks;
+    auto table = dispatch_table;
+    retire([dev, handle, callbacks, table]() {
+      dev.destroy(handle, callbacks, table ? *table : VULKAN_HPP_DEFAULT_DISPATCHER);
+    });
+  }
+
+  // Tag everything retired since the last call with the values submitted
+  // so far, i.e. with the frame that was just submitted.
+  void endFrame() {
+    std::vector<SubmitToken> values;
+    values.reserve(timelines.size());
+    for (auto &timeline : timelines)
+      values.push_back(timeline ? timeline->submittedValue() : 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &destroyer : open)
+      entries.push_back(Entry{values, std::move(destroyer)});
+    open.clear();
+  }
+
+  // Destroy everything whose submissions have completed. Returns the number
+  // of destroyed entries.
+  size_t collect() {
+    std::vector<Entry> ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (!entries.empty() && is_ready(entries.front())) {
+        ready.push_back(std::move(entries.front()));
+        entries.pop_front();
+      }
+    }
+    for (auto &entry : ready)
+      entry.destroyer();
+    return ready.size();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size() + open.size();
+  }
+
+  // Wait for every queue and destroy everything.
+  void flush() {
+    endFrame();
+    for (auto &timeline : timelines)
+      if (timeline) timeline->waitIdle();
+    collect();
+  }
+
+  void destroy() {
+    if (!device)
+      return;
+    flush();
+    device = vk::Device();
+  }
+
+private:
+  struct Entry {
+    std::vector<SubmitToken> values;
+    std::function<void()> destroyer;
+  };
+
+  bool is_ready(const Entry &entry) {
+    for (size_t i = 0; i < timelines.size(); ++i)
+      if (timelines[i] && !timelines[i]->isComplete(entry.values[i]))
+        return false;
+    return true;
+  }
+
+  vk::Device device;
+  std::vector<std::shared_ptr<QueueTimeline>> timelines;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table;
+
+  mutable std::mutex mutex;
+  std::deque<Entry> entries;
+  // Retired since the last endFrame(), not tagged yet.
+  std::vector<std::function<void()>> open;
+};
+
+// Recycles fences. release() resets the returned fences with a single
+// vkResetFences call and keeps them for later acquire() calls, so only a
+// pool miss creates a fence. Acquired fences are unsignaled. A fence must be
+// signaled, or never submitted, when it is released.
+class FencePool {
+public:
+  FencePool(vk::Device device,
+            vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr,
+            std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table = nullptr)
+      : device(device), allocation_callbacks(allocation_callbacks),
+        dispatch_table(std::move(dispatch_table)) {}
+
+  FencePool(const FencePool &) = delete;
+  FencePool &operator=(const FencePool &) = delete;
+  ~FencePool() { destroy(); }
+
+  vk::Fence acquire() { return acquire(1)[0]; }
+
+  std::vector<vk::Fence> acquire(uint32_t count) {
+    std::vector<vk::Fence> fences;
+    fences.reserve(count);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (fences.size() < count && !free_fences.empty()) {
+        fences.push_back(free_fences.back());
+        free_fences.pop_back();
+      }
+      created += count - fences.size();
+    }
+    while (fences.size() < count)
+      fences.push_back(device.createFence(vk::FenceCreateInfo{}, allocation_callbacks, dispatch()));
+    return fences;
+  }
+
+  void release(vk::Fence fence) { release(std::vector<vk::Fence>{fence}); }
+
+  void release(const std::vector<vk::Fence> &fences) {
+    if (fences.empty())
+      return;
+    device.resetFences(static_cast<uint32_t>(fences.size()), fences.data(), dispatch());
+    std::lock_guard<std::mutex> lock(mutex);
+    free_fences.insert(free_fences.end(), fences.begin(), fences.end());
+  }
+
+  // Fences ready for reuse.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return free_fences.size();
+  }
+
+  // Fences created since the pool was made.
+  size_t createdCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return created;
+  }
+
+  const vk::DispatchLoaderDynamic &dispatch() const {
+    return dispatch_table ? *dispatch_table : VULKAN_HPP_DEFAULT_DISPATCHER;
+  }
+
+  // Fences that are still acquired are not destroyed.
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto fence : free_fences)
+      device.destroyFence(fence, allocation_callbacks, dispatch());
+    free_fences.clear();
+  }
+
+private:
+  vk::Device device;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table;
+
+  mutable std::mutex mutex;
+  std::vector<vk::Fence> free_fences;
+  size_t created = 0;
+};
+
+// Recycles binary semaphores. A semaphore must be unsignaled and have no
+// pending wait when it is released, retire it through the DeletionQueue
+// when frames in flight may still use it (see Device::retireSemaphores).
+class SemaphorePool {
+public:
+  SemaphorePool(vk::Device device,
+                vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr,
+                std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table = nullptr)
+      : device(device), allocation_callbacks(allocation_callbacks),
+        dispatch_table(std::move(dispatch_table)) {}
+
+  SemaphorePool(const SemaphorePool &) = delete;
+  SemaphorePool &operator=(const SemaphorePool &) = delete;
+  ~SemaphorePool() { destroy(); }
+
+  vk::Semaphore acquire() { return acquire(1)[0]; }
+
+  std::vector<vk::Semaphore> acquire(uint32_t count) {
+    std::vector<vk::Semaphore> semaphores;
+    semaphores.reserve(count);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (semaphores.size() < count && !free_semaphores.empty()) {
+        semaphores.push_back(free_semaphores.back());
+        free_semaphores.pop_back();
+      }
+      created += count - semaphores.size();
+    }
+    while (semaphores.size() < count)
+      semaphores.push_back(device.createSemaphore(vk::SemaphoreCreateInfo{}, allocation_callbacks, dispatch()));
+    return semaphores;
+  }
+
+  void release(vk::Semaphore semaphore) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_semaphores.push_back(semaphore);
+  }
+
+  void release(const std::vector<vk::Semaphore> &semaphores) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_semaphores.insert(free_semaphores.end(), semaphores.begin(), semaphores.end());
+  }
+
+  // Semaphores ready for reuse.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return free_semaphores.size();
+  }
+
+  // Semaphores created since the pool was made.
+  size_t createdCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return created;
+  }
+
+  const vk::DispatchLoaderDynamic &dispatch() const {
+    return dispatch_table ? *dispatch_table : VULKAN_HPP_DEFAULT_DISPATCHER;
+  }
+
+  // Semaphores that are still acquired are not destroyed.
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto semaphore : free_semaphores)
+      device.destroySemaphore(semaphore, allocation_callbacks, dispatch());
+    free_semaphores.clear();
+  }
+
+private:
+  vk::Device device;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table;
+
+  mutable std::mutex mutex;
+  std::vector<vk::Semaphore> free_semaphores;
+  size_t created = 0;
+};
+
+#pragma endregion
+
+#pragma region Memory
+
+// A (memory, offset) range handed out by MemoryAllocator. Dedicated
+// allocations own their whole vk::DeviceMemory, the others point into a block
+// shared with other resources.
+struct MemoryAllocation {
+  vk::DeviceMemory memory;
+  vk::DeviceSize offset = 0;
+  vk::DeviceSize size = 0;
+  uint32_t memory_type = 0;
+  uint32_t block = 0;
+  bool dedicated = false;
+  // Host address of `offset` for host visible memory, null otherwise. Stays
+  // valid until the allocation is freed.
+  void *mapped = nullptr;
+
+  explicit operator bool() const { return bool(memory); }
+};
+
+// Block based sub-allocator for device memory, owned by vkb::Device.
+// Resources are packed into large vk::DeviceMemory blocks, so creating a
+// buffer no longer costs a vkAllocateMemory call and thousands of meshes stay
+// far below maxMemoryAllocationCount. Linear resources (buffers and linear
+// images) and optimal images never share a block, which keeps neighbours
+// clear of bufferImageGranularity. Resources larger than half a block get a
+// dedicated allocation. Host visible blocks are mapped once when they are
+// created and unmapped when they are released, so writing to host memory
+// never costs a vkMapMemory call.
+class MemoryAllocator {
+public:
+  static constexpr vk::DeviceSize default_block_size = 64ull * 1024 * 1024;
+
+  struct Stats {
+    uint32_t block_count = 0;
+    uint32_t dedicated_count = 0;
+    uint32_t allocation_count = 0;
+    vk::DeviceSize bytes_reserved = 0;
+    vk::DeviceSize bytes_used = 0;
+  };
+
+  MemoryAllocator(vk::Device device, const PhysicalDevice &physical_device,
+                  vk::DeviceSize block_size = default_block_size,
+                  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), memory_properties(physical_device.memory_properties),
+        granularity(physical_device.properties.limits.bufferImageGranularity),
+        atom_size(physical_device.properties.limits.nonCoherentAtomSize),
+        block_size(block_size), allocation_callbacks(allocation_callbacks) {}
+
+  MemoryAllocator(const MemoryAllocator &) = delete;
+  MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+  ~MemoryAllocator() { destroy(); }
+
+  // Find a range satisfying `requirements` in a memory type with `flags`.
+  // `linear` must be true for buffers and linear images and false for
+  // optimal images.
+  MemoryAllocation allocate(const vk::MemoryRequirements &requirements,
+                            vk::MemoryPropertyFlags flags, bool linear = true) {
+    uint32_t type = findMemoryTypeIndex(requirements.memoryTypeBits, flags);
+
+    vk::DeviceSize alignment = std::max<vk::DeviceSize>(requirements.alignment, 1);
+    vk::DeviceSize size = requirements.size;
+    // Flush and invalidate ranges must be multiples of nonCoherentAtomSize.
+    if (is_non_coherent(type)) {
+      alignment = std::max(alignment, atom_size);
+      size = align_up(size, atom_size);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    vk::DeviceSize type_block_size = block_size_for(type);
+    if (size > type_block_size / 2)
+      return allocate_dedicated(type, size);
+
+    for (uint32_t i = 0; i < static_cast<uint32_t>(blocks.size()); ++i) {
+      Block *block = blocks[i].get();
+      if (!block || block->dedicated || block->memory_type != type ||
+          block->linear != linear)
+        continue;
+      vk::DeviceSize offset;
+      if (block->take(size, alignment, offset))
+        return make_allocation(i, offset, size);
+    }
+
+    uint32_t index = create_block(type, type_block_size, linear, false);
+    vk::DeviceSize offset = 0;
+    blocks[index]->take(size, alignment, offset);
+    return make_allocation(index, offset, size);
+  }
+
+  // Return a range to its block. Dedicated blocks are released with their
+  // allocation. Of the other blocks one empty block per memory type and
+  // linear/optimal class is kept, so creating and destroying a resource in a
+  // loop doesn't cost a vkAllocateMemory every time, see trim().
+  void free(const MemoryAllocation &allocation) {
+    if (!allocation)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (allocation.block >= blocks.size() || !blocks[allocation.block])
+      return;
+    Block *block = blocks[allocation.block].get();
+    block->give_back(allocation.offset, allocation.size);
+    if (--block->allocations != 0)
+      return;
+    if (block->dedicated || has_empty_block(*block, allocation.block))
+      release_block(allocation.block);
+  }
+
+  // Release the empty blocks kept by free(), eg. after a level was unloaded.
+  void trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t i = 0; i < static_cast<uint32_t>(blocks.size()); ++i)
+      if (blocks[i] && blocks[i]->allocations == 0)
+        release_block(i);
+  }
+
+  // Pointer to the first byte of a host visible allocation. The block is
+  // persistently mapped, this is the same as allocation.mapped.
+  void *map(const MemoryAllocation &allocation) {
+    if (!allocation.mapped)
+      throw std::runtime_error("memory_not_host_visible");
+    return allocation.mapped;
+  }
+
+  // Nothing to do, the mapping lives as long as the block.
+  void unmap(const MemoryAllocation &) {}
+
+  uint32_t findMemoryTypeIndex(uint32_t typeFilter, vk::MemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+      if ((typeFilter & (1 << i)) &&
+          (memory_properties.memoryTypes[i].propertyFlags & properties) == properties) {
+        return i;
+      }
+    }
+    throw std::runtime_error("failed to find suitable memory type!");
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats result;
+    for (auto &block : blocks) {
+      if (!block) continue;
+      if (block->dedicated) result.dedicated_count++;
+      else result.block_count++;
+      result.allocation_count += block->allocations;
+      result.bytes_reserved += block->size;
+      result.bytes_used += block->used;
+    }
+    return result;
+  }
+
+  vk::DeviceSize get_buffer_image_granularity() const { return granularity; }
+
+  // Free every block. Called by Device::destroy before the device goes away.
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t i = 0; i < static_cast<uint32_t>(blocks.size()); ++i)
+      if (blocks[i]) release_block(i);
+    blocks.clear();
+  }
+
+private:
+  struct Block {
+    vk::DeviceMemory memory;
+    vk::DeviceSize size = 0;
+    vk::DeviceSize used = 0;
+    uint32_t memory_type = 0;
+    uint32_t allocations = 0;
+    bool linear = true;
+    bool dedicated = false;
+    void *mapped = nullptr;
+    // offset -> size of every free range, kept coalesced.
+    std::map<vk::DeviceSize, vk::DeviceSize> free_ranges;
+
+    bool take(vk::DeviceSize bytes, vk::DeviceSize alignment, vk::DeviceSize &offset) {
+      for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+        vk::DeviceSize begin = it->first, end = it->first + it->second;
+        vk::DeviceSize aligned = align_up(begin, alignment);
+        if (aligned + bytes > end)
+          continue;
+        free_ranges.erase(it);
+        if (aligned > begin) free_ranges[begin] = aligned - begin;
+        if (aligned + bytes < end) free_ranges[aligned + bytes] = end - (aligned + bytes);
+        offset = aligned;
+        used += bytes;
+        allocations++;
+        return true;
+      }
+      return false;
+    }
+
+    void give_back(vk::DeviceSize offset, vk::DeviceSize bytes) {
+      used -= bytes;
+      auto it = free_ranges.emplace(offset, bytes).first;
+      auto next = std::next(it);
+      if (next != free_ranges.end() && it->first + it->second == next->first) {
+        it->second += next->second;
+        free_ranges.erase(next);
+      }
+      if (it != free_ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second == it->first) {
+          prev->second += it->second;
+          free_ranges.erase(it);
+        }
+      }
+    }
+  };
+
+  static vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  bool is_non_coherent(uint32_t type) const {
+    auto flags = memory_properties.memoryTypes[type].propertyFlags;
+    return (flags & vk::MemoryPropertyFlagBits::eHostVisible) &&
+           !(flags & vk::MemoryPropertyFlagBits::eHostCoherent);
+  }
+
+  // Small heaps (eg. the 256MB host visible device local heap) get smaller
+  // blocks so a single block cannot exhaust them.
+  vk::DeviceSize block_size_for(uint32_t type) const {
+    auto heap = memory_properties.memoryTypes[type].heapIndex;
+    return std::min(block_size, memory_properties.memoryHeaps[heap].size / 8);
+  }
+
+  uint32_t create_block(uint32_t type, vk::DeviceSize size, bool linear, bool dedicated) {
+    vk::MemoryAllocateInfo info{};
+    info.allocationSize = size;
+    info.memoryTypeIndex = type;
+
+    auto block = std::make_unique<Block>();
+    block->memory = device.allocateMemory(info, allocation_callbacks);
+    block->size = size;
+    block->memory_type = type;
+    block->linear = linear;
+    block->dedicated = dedicated;
+    block->free_ranges[0] = size;
+    if (memory_properties.memoryTypes[type].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+      block->mapped = device.mapMemory(block->memory, 0, VK_WHOLE_SIZE, vk::MemoryMapFlags{});
+
+    for (uint32_t i = 0; i < static_cast<uint32_t>(blocks.size()); ++i) {
+      if (!blocks[i]) {
+        blocks[i] = std::move(block);
+        return i;
+      }
+    }
+    blocks.push_back(std::move(block));
+    return static_cast<uint32_t>(blocks.size() - 1);
+  }
+
+  MemoryAllocation allocate_dedicated(uint32_t type, vk::DeviceSize size) {
+    uint32_t index = create_block(type, size, true, true);
+    vk::DeviceSize offset = 0;
+    blocks[index]->take(size, 1, offset);
+    return make_allocation(index, offset, size);
+  }
+
+  MemoryAllocation make_allocation(uint32_t index, vk::DeviceSize offset, vk::DeviceSize size) const {
+    MemoryAllocation allocation;
+    allocation.memory = blocks[index]->memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.memory_type = blocks[index]->memory_type;
+    allocation.block = index;
+    allocation.dedicated = blocks[index]->dedicated;
+    if (blocks[index]->mapped)
+      allocation.mapped = static_cast<uint8_t *>(blocks[index]->mapped) + offset;
+    return allocation;
+  }
+
+  // Another empty block that could take the allocations of `block`.
+  bool has_empty_block(const Block &block, uint32_t except) const {
+    for (uint32_t i = 0; i < static_cast<uint32_t>(blocks.size()); ++i) {
+      const Block *other = blocks[i].get();
+      if (i != except && other && !other->dedicated && other->allocations == 0 &&
+          other->memory_type == block.memory_type && other->linear == block.linear)
+        return true;
+    }
+    return false;
+  }
+
+  void release_block(uint32_t index) {
+    Block *block = blocks[index].get();
+    if (block->mapped)
+      device.unmapMemory(block->memory);
+    device.freeMemory(block->memory, allocation_callbacks);
+    blocks[index].reset();
+  }
+
+  vk::Device device;
+  vk::PhysicalDeviceMemoryProperties memory_properties;
+  vk::DeviceSize granularity;
+  vk::DeviceSize atom_size;
+  vk::DeviceSize block_size;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<Block> > blocks;
+};
+
+// Move-only owner of a MemoryAllocation, the allocator counterpart of
+// vk::UniqueDeviceMemory.
+class UniqueMemoryAllocation {
+public:
+  UniqueMemoryAllocation() {}
+  UniqueMemoryAllocation(std::shared_ptr<MemoryAllocator> allocator, MemoryAllocation allocation)
+      : allocator(std::move(allocator)), allocation(allocation) {}
+  UniqueMemoryAllocation(UniqueMemoryAllocation &&other) noexcept
+      : allocator(std::move(other.allocator)), allocation(other.allocation) {
+    other.allocation = MemoryAllocation{};
+  }
+  UniqueMemoryAllocation &operator=(UniqueMemoryAllocation &&other) noexcept {
+    if (this != &other) {
+      reset();
+      allocator = std::move(other.allocator);
+      allocation = other.allocation;
+      other.allocation = MemoryAllocation{};
+    }
+    return *this;
+  }
+  ~UniqueMemoryAllocation() { reset(); }
+
+  const MemoryAllocation &get() const { return allocation; }
+  const MemoryAllocation &operator*() const { return allocation; }
+  const MemoryAllocation *operator->() const { return &allocation; }
+  explicit operator bool() const { return bool(allocation); }
+
+  void reset() {
+    if (allocator && allocation)
+      allocator->free(allocation);
+    allocation = MemoryAllocation{};
+  }
+
+  // Give up ownership without freeing.
+  MemoryAllocation release() {
+    MemoryAllocation result = allocation;
+    allocation = MemoryAllocation{};
+    return result;
+  }
+
+private:
+  std::shared_ptr<MemoryAllocator> allocator;
+  MemoryAllocation allocation;
+};
+
+// Persistently mapped ring of host visible memory, owned by vkb::Device and
+// used as the source of GenericBuffer::upload and GenericImage::upload.
+// Regions are handed out in order and reclaimed once the submission reading
+// them has completed, so sustained uploads keep reusing the same memory
+// instead of creating a staging buffer per call.
+class StagingRing {
+public:
+  static constexpr vk::DeviceSize default_capacity = 32ull * 1024 * 1024;
+
+  struct Region {
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    void *data = nullptr;
+    uint64_t id = 0;
+  };
+
+  StagingRing(vk::Device device, std::shared_ptr<MemoryAllocator> allocator,
+              vk::DeviceSize capacity = default_capacity,
+              vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), allocator(std::move(allocator)), capacity(capacity),
+        allocation_callbacks(allocation_callbacks) {
+    vk::BufferCreateInfo ci{};
+    ci.size = capacity;
+    ci.usage = vk::BufferUsageFlagBits::eTransferSrc;
+    ci.sharingMode = vk::SharingMode::eExclusive;
+    buffer = device.createBuffer(ci, allocation_callbacks);
+
+    auto memreq = device.getBufferMemoryRequirements(buffer);
+    memory = this->allocator->allocate(memreq,
+        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, true);
+    device.bindBufferMemory(buffer, memory.memory, memory.offset);
+    data = static_cast<uint8_t *>(memory.mapped);
+  }
+
+  StagingRing(const StagingRing &) = delete;
+  StagingRing &operator=(const StagingRing &) = delete;
+  ~StagingRing() { destroy(); }
+
+  // Reserve `size` bytes. Blocks on the oldest outstanding upload when the
+  // ring is full, also while another thread has it allocated but not yet
+  // retired, and throws if `size` can never fit. A thread must retire its
+  // own regions before allocating again or it can wait forever.
+  Region allocate(vk::DeviceSize size, vk::DeviceSize alignment = 16) {
+    if (size > capacity)
+      throw std::runtime_error("staging_ring_too_small");
+
+    std::unique_lock<std::mutex> lock(mutex);
+    reclaim(false);
+    vk::DeviceSize offset = 0;
+    while (!fits(size, alignment, offset)) {
+      if (records.front().retired)
+        reclaim(true);
+      else
+        retired_cv.wait(lock);
+    }
+
+    head = offset + size;
+    Record record;
+    record.end = head;
+    records.push_back(record);
+
+    Region region;
+    region.buffer = buffer;
+    region.offset = offset;
+    region.size = size;
+    region.data = data + offset;
+    region.id = first_id + records.size() - 1;
+    return region;
+  }
+
+  // Hand back `region`, which is read by the submission behind `token` on
+  // `context`. The space is reused once that submission completes. Without a
+  // context the region is free right away.
+  void retire(const Region &region, ImmediateContext *context = nullptr,
+              SubmitToken token = 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Record &record = records.at(static_cast<size_t>(region.id - first_id));
+    record.retired = true;
+    record.context = context;
+    record.token = token;
+    retired_cv.notify_all();
+  }
+
+  vk::DeviceSize get_capacity() const { return capacity; }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!buffer)
+      return;
+    for (auto &record : records)
+      if (record.context) record.context->wait(record.token);
+    records.clear();
+    device.destroyBuffer(buffer, allocation_callbacks);
+    allocator->free(memory);
+    buffer = vk::Buffer();
+  }
+
+private:
+  struct Record {
+    vk::DeviceSize end = 0;
+    bool retired = false;
+    ImmediateContext *context = nullptr;
+    SubmitToken token = 0;
+  };
+
+  static vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  // Live data is [tail, head), wrapping around the end of the ring.
+  bool fits(vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize &offset) {
+    if (records.empty())
+      head = tail = 0;
+    vk::DeviceSize aligned = align_up(head, alignment);
+    if (records.empty() || head > tail) {
+      if (aligned + size <= capacity) {
+        offset = aligned;
+        return true;
+      }
+      if (size <= tail) {
+        offset = 0;
+        return true;
+      }
+      return false;
+    }
+    if (aligned + size <= tail) {
+      offset = aligned;
+      return true;
+    }
+    return false;
+  }
+
+  // Release finished regions from the front of the ring. With `wait` set the
+  // oldest region is waited on first.
+  void reclaim(bool wait) {
+    while (!records.empty() && records.front().retired) {
+      Record &front = records.front();
+      if (front.context) {
+        if (wait)
+          front.context->wait(front.token);
+        else if (!front.context->isComplete(front.token))
+          break;
+      }
+      wait = false;
+      tail = front.end;
+      records.pop_front();
+      first_id++;
+    }
+  }
+
+  vk::Device device;
+  std::shared_ptr<MemoryAllocator> allocator;
+  vk::DeviceSize capacity;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+
+  vk::Buffer buffer;
+  MemoryAllocation memory;
+  uint8_t *data = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable retired_cv;
+  vk::DeviceSize head = 0;
+  vk::DeviceSize tail = 0;
+  std::deque<Record> records;
+  uint64_t first_id = 0;
+};
+
+// Runs uploads on a transfer queue so that large copies overlap rendering.
+// Resources are released to the graphics queue family at the end of each
+// transfer submission, recordAcquire() records the matching acquire half
+// into a graphics command buffer and returns the timeline value the
+// graphics submission has to wait on. Present::begin does this every frame,
+// applications without Present call acquire() instead. If the device has no
+// separate transfer family the engine runs on the graphics queue and no
+// ownership transfer is needed.
+class TransferEngine {
+public:
+  // A `concurrent` buffer is shared with the transfer family
+  // (vk::SharingMode::eConcurrent), it needs a semaphore wait but no
+  // ownership transfer.
+  struct BufferTransfer {
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = VK_WHOLE_SIZE;
+    bool concurrent = false;
+  };
+
+  // `old_layout` is the layout the transfer commands leave the image in,
+  // the image is in `new_layout` once it is acquired.
+  struct ImageTransfer {
+    vk::Image image;
+    vk::ImageSubresourceRange range;
+    vk::ImageLayout old_layout = vk::ImageLayout::eTransferDstOptimal;
+    vk::ImageLayout new_layout = vk::ImageLayout::eShaderReadOnlyOptimal;
+  };
+
+  // Semaphore wait a graphics submission needs, empty if none.
+  using Wait = TimelineWait;
+
+  TransferEngine(vk::Device device, std::shared_ptr<StagingRing> staging,
+                 std::shared_ptr<QueueTimeline> transfer,
+                 std::shared_ptr<QueueTimeline> graphics,
+                 vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : staging(std::move(staging)), transfer(transfer), graphics(std::move(graphics)),
+        context(std::make_shared<ImmediateContext>(device, transfer, allocation_callbacks)) {}
+
+  TransferEngine(const TransferEngine &) = delete;
+  TransferEngine &operator=(const TransferEngine &) = delete;
+
+  // True if copies run on their own queue family and need ownership
+  // transfers.
+  bool isSeparateQueue() const {
+    return transfer->get_queue_family() != graphics->get_queue_family();
+  }
+
+  // Record `func` on the transfer queue, then release `buffers` and `images`
+  // to the graphics family. The commands start after all graphics work
+  // submitted so far, so resources read by frames still in flight can be
+  // overwritten. On a separate transfer queue without timeline semaphores
+  // this blocks until the graphics queue has caught up.
+  SubmitToken submit(const std::function<void(vk::CommandBuffer cb)> &func,
+                     const std::vector<BufferTransfer> &buffers,
+                     const std::vector<ImageTransfer> &images = {}) {
+    bool same_queue = transfer == graphics;
+    std::vector<TimelineWait> waits;
+    if (!same_queue)
+      waits.push_back(graphics->waitInfo(graphics->submittedValue(), vk::PipelineStageFlagBits::eTransfer));
+    SubmitToken token = context->submit([&](vk::CommandBuffer cb) {
+      // Submission order on the same queue, only the execution dependency
+      // is missing.
+      if (same_queue)
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer,
+                           {}, nullptr, nullptr, nullptr, dispatch());
+      func(cb);
+      record_release(cb, buffers, images);
+    }, waits);
+    if (isSeparateQueue()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto &b : buffers)
+        if (!b.concurrent) pending_buffers.push_back(b);
+      pending_images.insert(pending_images.end(), images.begin(), images.end());
+      pending_value = std::max(pending_value, token);
+    }
+    return token;
+  }
+
+  // Copy `size` bytes into `buffer`, which is `buffer_size` bytes long, at
+  // `offset` through the staging ring. `concurrent` as in BufferTransfer.
+  //
+  // On a separate transfer family an exclusive buffer changes owner and
+  // bytes outside the copied range would be lost, so it can only be
+  // uploaded in full and this throws otherwise. Buffers updated in parts
+  // must be created concurrent (GenericBuffer's `shared`).
+  SubmitToken upload(vk::Buffer buffer, vk::DeviceSize buffer_size, vk::DeviceSize offset, const void *data,
+                     vk::DeviceSize size, bool concurrent = false) {
+    if (size == 0) return 0;
+    if (offset + size > buffer_size)
+      throw std::runtime_error("invalid_upload_range");
+    if (!concurrent && isSeparateQueue() && (offset != 0 || size != buffer_size))
+      throw std::runtime_error("partial_upload_needs_concurrent_buffer");
+    auto region = staging->allocate(size);
+    memcpy(region.data, data, (size_t)size);
+    SubmitToken token;
+    try {
+      token = submit([&](vk::CommandBuffer cb) {
+        vk::BufferCopy bc{region.offset, offset, size};
+        cb.copyBuffer(region.buffer, buffer, bc, dispatch());
+      }, {BufferTransfer{buffer, 0, VK_WHOLE_SIZE, concurrent}});
+    } catch (...) {
+      // Nothing reads the region, it must not hold up the ring.
+      staging->retire(region);
+      throw;
+    }
+    staging->retire(region, context.get(), token);
+    return token;
+  }
+
+  // Record the acquire barriers of every transfer submitted so far into
+  // `cb`, which must be submitted on the graphics queue. Without timeline
+  // semaphores the host waits for the transfers and the returned wait is
+  // empty.
+  Wait recordAcquire(vk::CommandBuffer cb) {
+    Pending taken = take_pending();
+    if (taken.value == 0)
+      return Wait{};
+    record_acquire(cb, taken);
+    return transfer->waitInfo(taken.value, vk::PipelineStageFlagBits::eAllCommands);
+  }
+
+  // True if transfers were submitted since the last acquire.
+  bool hasPending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending_value != 0;
+  }
+
+  // Submit the acquire barriers of every transfer submitted so far on
+  // `graphics_context` (eg. Device::immediate), for applications that don't
+  // use Present. Later graphics submissions are ordered after it. Returns 0
+  // if nothing was pending.
+  SubmitToken acquire(ImmediateContext &graphics_context) {
+    Pending taken = take_pending();
+    if (taken.value == 0)
+      return 0;
+    Wait wait = transfer->waitInfo(taken.value, vk::PipelineStageFlagBits::eAllCommands);
+    return graphics_context.submit([&](vk::CommandBuffer cb) { record_acquire(cb, taken); }, {wait});
+  }
+
+  const std::shared_ptr<ImmediateContext> &get_context() const { return context; }
+  const std::shared_ptr<QueueTimeline> &get_timeline() const { return transfer; }
+  const vk::DispatchLoaderDynamic &dispatch() const { return transfer->dispatch(); }
+
+  void destroy() { context->destroy(); }
+
+private:
+  struct Pending {
+    std::vector<BufferTransfer> buffers;
+    std::vector<ImageTransfer> images;
+    SubmitToken value = 0;
+  };
+
+  Pending take_pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Pending taken;
+    taken.buffers.swap(pending_buffers);
+    taken.images.swap(pending_images);
+    taken.value = pending_value;
+    pending_value = 0;
+    return taken;
+  }
+
+  void record_acquire(vk::CommandBuffer cb, const Pending &taken) {
+    std::vector<vk::BufferMemoryBarrier> buffer_barriers;
+    for (auto &b : taken.buffers)
+      buffer_barriers.emplace_back(vk::AccessFlags(), vk::AccessFlagBits::eMemoryRead,
+                                   transfer->get_queue_family(), graphics->get_queue_family(),
+                                   b.buffer, b.offset, b.size);
+    std::vector<vk::ImageMemoryBarrier> image_barriers;
+    for (auto &i : taken.images)
+      image_barriers.emplace_back(vk::AccessFlags(), vk::AccessFlagBits::eMemoryRead,
+                                  i.old_layout, i.new_layout,
+                                  transfer->get_queue_family(), graphics->get_queue_family(),
+                                  i.image, i.range);
+    if (!buffer_barriers.empty() || !image_barriers.empty())
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eAllCommands,
+                         {}, nullptr, buffer_barriers, image_barriers, graphics->dispatch());
+  }
+
+  void record_release(vk::CommandBuffer cb, const std::vector<BufferTransfer> &buffers,
+                      const std::vector<ImageTransfer> &images) {
+    if (buffers.empty() && images.empty())
+      return;
+    // On a shared queue a plain barrier makes the copies visible to later
+    // submissions.
+    bool separate = isSeparateQueue();
+    uint32_t src_family = separate ? transfer->get_queue_family() : VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dst_family = separate ? graphics->get_queue_family() : VK_QUEUE_FAMILY_IGNORED;
+    vk::AccessFlags dst_access = separate ? vk::AccessFlags() : vk::AccessFlagBits::eMemoryRead;
+    vk::PipelineStageFlags dst_stage = separate ? vk::PipelineStageFlagBits::eBottomOfPipe
+                                                : vk::PipelineStageFlagBits::eAllCommands;
+
+    std::vector<vk::BufferMemoryBarrier> buffer_barriers;
+    for (auto &b : buffers) {
+      // Concurrent buffers must not have queue family ownership transfers.
+      if (b.concurrent) {
+        dst_stage |= vk::PipelineStageFlagBits::eAllCommands;
+        buffer_barriers.emplace_back(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eMemoryRead,
+                                     VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, b.buffer, b.offset, b.size);
+      } else {
+        buffer_barriers.emplace_back(vk::AccessFlagBits::eTransferWrite, dst_access,
+                                     src_family, dst_family, b.buffer, b.offset, b.size);
+      }
+    }
+    std::vector<vk::ImageMemoryBarrier> image_barriers;
+    for (auto &i : images)
+      image_barriers.emplace_back(vk::AccessFlagBits::eTransferWrite, dst_access,
+                                  i.old_layout, i.new_layout, src_family, dst_family,
+                                  i.image, i.range);
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, dst_stage, {}, nullptr,
+                       buffer_barriers, image_barriers, dispatch());
+  }
+
+  std::shared_ptr<StagingRing> staging;
+  std::shared_ptr<QueueTimeline> transfer;
+  std::shared_ptr<QueueTimeline> graphics;
+  std::shared_ptr<ImmediateContext> context;
+
+  std::mutex mutex;
+  std::vector<BufferTransfer> pending_buffers;
+  std::vector<ImageTransfer> pending_images;
+  SubmitToken pending_value = 0;
+};
+
+#pragma endregion
+
+#pragma region PipelineCache
+
+// Device-owned vk::PipelineCache that every PipelineBuilder::build goes
+// through. With a path set, the cache is seeded from disk on creation and
+// written back by save() / Device::destroy(), so pipelines compiled by an
+// earlier run of the application are not compiled again.
+class PipelineCache {
+public:
+  PipelineCache(vk::Device device, const PhysicalDevice &physical_device,
+                std::string path = "",
+                vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), properties(physical_device.properties),
+        path(std::move(path)), allocation_callbacks(allocation_callbacks) {
+    std::vector<uint8_t> data;
+    if (!this->path.empty()) {
+      data = readFile(this->path);
+      if (!isCompatible(data.data(), data.size(), properties))
+        data.clear();
+    }
+    loaded_size = data.size();
+
+    vk::PipelineCacheCreateInfo info;
+    info.initialDataSize = data.size();
+    info.pInitialData = data.empty() ? nullptr : data.data();
+    cache = device.createPipelineCache(info, allocation_callbacks);
+  }
+
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+  ~PipelineCache() { destroy(); }
+
+  operator vk::PipelineCache() const { return cache; }
+  vk::PipelineCache get() const { return cache; }
+  const std::string &get_path() const { return path; }
+
+  // Size of the data accepted from disk, 0 on a cold start.
+  size_t get_loaded_size() const { return loaded_size; }
+  bool isWarm() const { return loaded_size != 0; }
+
+  // Write the cache to disk. The data goes to `<path>.tmp` first and is then
+  // renamed over `path`, so an interrupted write never leaves a truncated
+  // cache behind. Returns false if there is no path or the write failed.
+  bool save() const {
+    if (!cache || path.empty())
+      return false;
+
+    size_t size = 0;
+    if (device.getPipelineCacheData(cache, &size, nullptr) != vk::Result::eSuccess)
+      return false;
+    std::vector<uint8_t> data(size);
+    if (device.getPipelineCacheData(cache, &size, data.data()) != vk::Result::eSuccess)
+      return false;
+    data.resize(size);
+    if (!isCompatible(data.data(), data.size(), properties))
+      return false;
+
+    // The data must be on disk before the rename, or a crash can leave an
+    // empty or torn file under the final name.
+    std::string tmp = path + ".tmp";
+    if (!writeDurably(tmp, data.data(), data.size())) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+#if defined(_WIN32)
+    if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+#else
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+    // Make the rename itself durable.
+    std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (dir_fd >= 0) {
+      ::fsync(dir_fd);
+      ::close(dir_fd);
+    }
+#endif
+    return true;
+  }
+
+  void destroy() {
+    if (!cache)
+      return;
+    save();
+    device.destroyPipelineCache(cache, allocation_callbacks);
+    cache = nullptr;
+  }
+
+  // Checks the VkPipelineCacheHeaderVersionOne at the start of `data`
+  // against the device. Data written by another driver, GPU or driver
+  // version is rejected.
+  static bool isCompatible(const uint8_t *data, size_t size,
+                           const vk::PhysicalDeviceProperties &properties) {
+    const size_t header_size = 16 + VK_UUID_SIZE;
+    if (data == nullptr || size < header_size)
+      return false;
+
+    uint32_t fields[4];
+    std::memcpy(fields, data, sizeof(fields));
+    if (fields[0] < header_size || fields[0] > size)
+      return false;
+    if (fields[1] != static_cast<uint32_t>(vk::PipelineCacheHeaderVersion::eOne))
+      return false;
+    if (fields[2] != properties.vendorID || fields[3] != properties.deviceID)
+      return false;
+    return std::memcmp(data + 16, properties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+  }
+
+private:
+  // Write `size` bytes to a new file at `path` and flush them to disk.
+  static bool writeDurably(const std::string &path, const uint8_t *data, size_t size) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+    bool ok = true;
+    while (ok && size > 0) {
+      DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+      DWORD written = 0;
+      ok = WriteFile(file, data, chunk, &written, nullptr) && written > 0;
+      data += written;
+      size -= written;
+    }
+    ok = ok && FlushFileBuffers(file);
+    CloseHandle(file);
+    return ok;
+#else
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return false;
+    bool ok = true;
+    while (ok && size > 0) {
+      ssize_t written = ::write(fd, data, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      ok = written > 0;
+      if (ok) {
+        data += written;
+        size -= static_cast<size_t>(written);
+      }
+    }
+    ok = ok && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    return ok;
+#endif
+  }
+
+  static std::vector<uint8_t> readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+      return {};
+    std::streamsize size = file.tellg();
+    if (size <= 0)
+      return {};
+    std::vector<uint8_t> data(static_cast<size_t>(size));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(data.data()), size))
+      return {};
+    return data;
+  }
+
+  vk::Device device;
+  vk::PhysicalDeviceProperties properties;
+  std::string path;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+  vk::PipelineCache cache;
+  size_t loaded_size = 0;
+};
+
+#pragma endregion
+
+#pragma region LayoutCache
+
+// Device-owned cache of descriptor set layouts and pipeline layouts. Equal
+// descriptions return the same handle, so pipelines built from the same set
+// layouts and push constant ranges share one vk::PipelineLayout and are
+// trivially layout compatible. All handles live until Device::destroy().
+class LayoutCache {
+public:
+  LayoutCache(vk::Device device,
+              vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), allocation_callbacks(allocation_callbacks) {}
+
+  LayoutCache(const LayoutCache &) = delete;
+  LayoutCache &operator=(const LayoutCache &) = delete;
+  ~LayoutCache() { destroy(); }
+
+  vk::DescriptorSetLayout getDescriptorSetLayout(
+      const std::vector<vk::DescriptorSetLayoutBinding> &bindings,
+      vk::DescriptorSetLayoutCreateFlags flags = {}) {
+    // Binding order does not change the layout, sort before building the key.
+    std::vector<vk::DescriptorSetLayoutBinding> sorted = bindings;
+    std::sort(sorted.begin(), sorted.end(),
+              [](const vk::DescriptorSetLayoutBinding &a,
+                 const vk::DescriptorSetLayoutBinding &b) { return a.binding < b.binding; });
+
+    Key key;
+    key.push_back(static_cast<VkDescriptorSetLayoutCreateFlags>(flags));
+    for (auto &b : sorted) {
+      key.push_back(b.binding);
+      key.push_back(static_cast<uint64_t>(b.descriptorType));
+      key.push_back(b.descriptorCount);
+      key.push_back(static_cast<VkShaderStageFlags>(b.stageFlags));
+      uint32_t samplers = b.pImmutableSamplers ? b.descriptorCount : 0;
+      key.push_back(samplers);
+      for (uint32_t i = 0; i < samplers; ++i)
+        key.push_back((uint64_t)static_cast<VkSampler>(b.pImmutableSamplers[i]));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = set_layouts.find(key);
+    if (it != set_layouts.end())
+      return it->second;
+
+    vk::DescriptorSetLayoutCreateInfo info;
+    info.flags = flags;
+    info.bindingCount = static_cast<uint32_t>(sorted.size());
+    info.pBindings = sorted.data();
+    auto layout = device.createDescriptorSetLayout(info, allocation_callbacks);
+    set_layouts.emplace(std::move(key), layout);
+    return layout;
+  }
+
+  vk::PipelineLayout getPipelineLayout(
+      const std::vector<vk::DescriptorSetLayout> &layouts,
+      const std::vector<vk::PushConstantRange> &push_constant_ranges = {}) {
+    Key key;
+    key.push_back(layouts.size());
+    for (auto layout : layouts)
+      key.push_back((uint64_t)static_cast<VkDescriptorSetLayout>(layout));
+    for (auto &range : push_constant_ranges) {
+      key.push_back(static_cast<VkShaderStageFlags>(range.stageFlags));
+      key.push_back(range.offset);
+      key.push_back(range.size);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pipeline_layouts.find(key);
+    if (it != pipeline_layouts.end())
+      return it->second;
+
+    vk::PipelineLayoutCreateInfo info;
+    info.setLayoutCount = static_cast<uint32_t>(layouts.size());
+    info.pSetLayouts = layouts.data();
+    info.pushConstantRangeCount = static_cast<uint32_t>(push_constant_ranges.size());
+    info.pPushConstantRanges = push_constant_ranges.data();
+    auto layout = device.createPipelineLayout(info, allocation_callbacks);
+    pipeline_layouts.emplace(std::move(key), layout);
+    return layout;
+  }
+
+  size_t descriptorSetLayoutCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return set_layouts.size();
+  }
+
+  size_t pipelineLayoutCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pipeline_layouts.size();
+  }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : pipeline_layouts)
+      device.destroyPipelineLayout(entry.second, allocation_callbacks);
+    for (auto &entry : set_layouts)
+      device.destroyDescriptorSetLayout(entry.second, allocation_callbacks);
+    pipeline_layouts.clear();
+    set_layouts.clear();
+  }
+
+private:
+  // The full description, so equal hashes never alias different layouts.
+  using Key = std::vector<uint64_t>;
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      uint64_t hash = 14695981039346656037ull;
+      for (uint64_t word : key) {
+        hash ^= word;
+        hash *= 1099511628211ull;
+      }
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  vk::Device device;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+
+  mutable std::mutex mutex;
+  std::unordered_map<Key, vk::DescriptorSetLayout, KeyHash> set_layouts;
+  std::unordered_map<Key, vk::PipelineLayout, KeyHash> pipeline_layouts;
+};
+
+#pragma endregion
+
+#pragma region Shader
+
+// Read-only memory mapping of a whole file. The mapping is page aligned, so
+// SPIR-V can be handed to vkCreateShaderModule straight from it.
+class MappedFile {
+public:
+  MappedFile() {}
+  explicit MappedFile(const std::string &path) { open(path); }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+      close();
+      std::swap(bytes, other.bytes);
+      std::swap(length, other.length);
+#if defined(_WIN32)
+      std::swap(mapping, other.mapping);
+#endif
+    }
+    return *this;
+  }
+  ~MappedFile() { close(); }
+
+  // Returns false if the file can't be opened or is empty.
+  bool open(const std::string &path) {
+    close();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping) {
+        bytes = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (bytes) {
+          length = static_cast<size_t>(file_size.QuadPart);
+        } else {
+          CloseHandle(mapping);
+          mapping = nullptr;
+        }
+      }
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+        bytes = static_cast<const uint8_t *>(ptr);
+        length = static_cast<size_t>(st.st_size);
+      }
+    }
+    ::close(fd);
+#endif
+    return bytes != nullptr;
+  }
+
+  void close() {
+    if (!bytes)
+      return;
+#if defined(_WIN32)
+    UnmapViewOfFile(bytes);
+    CloseHandle(mapping);
+    mapping = nullptr;
+#else
+    munmap(const_cast<uint8_t *>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+  }
+
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+  explicit operator bool() const { return bytes != nullptr; }
+
+private:
+  const uint8_t *bytes = nullptr;
+  size_t length = 0;
+#if defined(_WIN32)
+  HANDLE mapping = nullptr;
+#endif
+};
+
+// Device-owned shader module registry. SPIR-V is looked up by a 64-bit
+// FNV-1a hash of its contents plus its size and compared in full on a hit,
+// so identical code loaded from different files or passed in by several
+// PipelineBuilders becomes a single vk::ShaderModule. Files are
+// memory-mapped and the mapping of each new module is kept for the
+// comparison, code passed in from memory is copied. Modules live until
+// Device::destroy().
+class ShaderRegistry {
+public:
+  ShaderRegistry(vk::Device device,
+                 vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr)
+      : device(device), allocation_callbacks(allocation_callbacks) {}
+
+  ShaderRegistry(const ShaderRegistry &) = delete;
+  ShaderRegistry &operator=(const ShaderRegistry &) = delete;
+  ~ShaderRegistry() { destroy(); }
+
+  // Module for the SPIR-V file at `path`. Files already loaded are not
+  // mapped again.
+  vk::ShaderModule load(const std::string &path) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = paths.find(path);
+      if (it != paths.end())
+        return it->second;
+    }
+
+    MappedFile file(path);
+    if (!file)
+      throw std::runtime_error("failed_open_shader_file: " + path);
+    auto code = reinterpret_cast<const uint32_t *>(file.data());
+    size_t size = file.size();
+    vk::ShaderModule module = insert(code, size, std::move(file));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    paths.emplace(path, module);
+    return module;
+  }
+
+  vk::ShaderModule get(const std::vector<uint32_t> &code) {
+    return get(code.data(), code.size() * sizeof(uint32_t));
+  }
+
+  // `size` is in bytes.
+  vk::ShaderModule get(const uint32_t *code, size_t size) {
+    return insert(code, size, MappedFile());
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return modules.size();
+  }
+
+  void destroy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &entry : modules)
+      device.destroyShaderModule(entry.second.module, allocation_callbacks);
+    modules.clear();
+    paths.clear();
+  }
+
+  static uint64_t hash(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+      h ^= bytes[i];
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+private:
+  using Key = std::pair<uint64_t, size_t>;
+
+  // Either `file` holds the code or, for code passed in from memory, `copy`.
+  struct Entry {
+    MappedFile file;
+    std::vector<uint32_t> copy;
+    vk::ShaderModule module;
+
+    const void *code() const { return file ? static_cast<const void *>(file.data()) : copy.data(); }
+  };
+
+  // `code` points into `file` when it is mapped, a new entry takes the
+  // mapping over instead of copying.
+  vk::ShaderModule insert(const uint32_t *code, size_t size, MappedFile file) {
+    if (size < 4 || size % 4 != 0 || code[0] != 0x07230203u)
+      throw std::runtime_error("invalid_spirv");
+
+    // The hash only narrows the search, a hit must have the same code.
+    Key key{hash(code, size), size};
+    std::lock_guard<std::mutex> lock(mutex);
+    auto range = modules.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it)
+      if (std::memcmp(it->second.code(), code, size) == 0)
+        return it->second.module;
+
+    vk::ShaderModuleCreateInfo info;
+    info.codeSize = size;
+    info.pCode = code;
+    Entry entry;
+    entry.module = device.createShaderModule(info, allocation_callbacks);
+    if (file)
+      entry.file = std::move(file);
+    else
+      entry.copy.assign(code, code + size / 4);
+    return modules.emplace(key, std::move(entry))->second.module;
+  }
+
+  vk::Device device;
+  vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+
+  mutable std::mutex mutex;
+  std::multimap<Key, Entry> modules;
+  std::unordered_map<std::string, vk::ShaderModule> paths;
+};
+
+#pragma endregion
+
+#pragma region Device
+
+enum class QueueType { present, graphics, compute, transfer };
+
+struct Device : Agent<vk::Device> {
+  PhysicalDevice physical_device;
+  vk::SurfaceKHR surface;
+  QueueFamilies queue_families;
+  // vkCmdDraw*IndirectCount is available, see
+  // DeviceBuilder::use_draw_indirect_count.
+  bool draw_indirect_count = false;
+
+  // Shared by every copy of this Device, created by DeviceBuilder::build.
+  std::shared_ptr<MemoryAllocator> allocator;
+  std::shared_ptr<StagingRing> staging;
+  // One timeline per created queue family, indexed by family, see timeline().
+  // These are the first queue of each family in `queues`.
+  std::vector<std::shared_ptr<QueueTimeline>> timelines;
+  // Every created queue, for spreading submissions over several threads.
+  std::shared_ptr<QueueManager> queues;
+  // Immediate submissions on the graphics queue, used by the upload helpers.
+  std::shared_ptr<ImmediateContext> immediate;
+  // Deferred destruction of resources that may still be in flight.
+  std::shared_ptr<DeletionQueue> deletion;
+  // Uploads on the dedicated or separate transfer queue, if there is one.
+  std::shared_ptr<TransferEngine> transfer;
+  // Dispatches on the dedicated or separate compute queue, if there is one.
+  std::shared_ptr<ComputeContext> compute;
+  // Used by every PipelineBuilder::build, saved to disk on destroy().
+  std::shared_ptr<PipelineCache> pipeline_cache;
+  // Shared descriptor set and pipeline layouts.
+  std::shared_ptr<LayoutCache> layouts;
+  // Shader modules, one per distinct SPIR-V.
+  std::shared_ptr<ShaderRegistry> shaders;
+  // Recycled fences and binary semaphores.
+  std::shared_ptr<FencePool> fences;
+  std::shared_ptr<SemaphorePool> semaphores;
+  // Device level function table, see DeviceBuilder::use_device_dispatch.
+  std::shared_ptr<vk::DispatchLoaderDynamic> dispatch_table;
+
+  // The table to pass to hot vulkan.hpp calls (command recording, submits,
+  // fence waits). Falls back to the global dispatcher when the device was
+  // built without its own table.
+  const vk::DispatchLoaderDynamic &dispatch() const {
+    return dispatch_table ? *dispatch_table : VULKAN_HPP_DEFAULT_DISPATCHER;
+  }
+
+  // Timeline of the first queue in `family`. Throws if the device has no
+  // queue in that family.
+  const std::shared_ptr<QueueTimeline> &timeline(uint32_t family) const {
+    if (family >= timelines.size() || !timelines[family])
+      throw std::runtime_error("no_queue_timeline");
+    return timelines[family];
+  }
+
+  const std::shared_ptr<QueueTimeline> &timeline(QueueType type) const {
+    return timeline(get_queue_index(type));
+  }
+
+  uint32_t get_queue_index(QueueType type) const {
+    uint32_t index = QUEUE_INDEX_MAX_VALUE;
+    switch (type) {
+    case QueueType::present:
+      index = queue_families.get_present_queue_index(
+          physical_device, surface);
+      break;
+    case QueueType::graphics:
+      index = queue_families.get_graphics_queue_index();
+      break;
+    case QueueType::compute:
+      index = queue_families.get_separate_compute_queue_index();
+      break;
+    case QueueType::transfer:
+      index = queue_families.get_separate_transfer_queue_index();
+      break;
+    default:
+      break;
+    }
+    return index;
+  }
+  // Only a compute or transfer queue type is valid. All other queue types do
+  // not support a 'dedicated' queue index
+  uint32_t get_dedicated_queue_index(QueueType type) const {
+    uint32_t index = QUEUE_INDEX_MAX_VALUE;
+    switch (type) {
+    case QueueType::compute:
+      index = queue_families.get_dedicated_compute_queue_index();
+      break;
+    case QueueType::transfer:
+      index = queue_families.get_dedicated_transfer_queue_index();
+      break;
+    default:
+      break;
+    }
+    return index;
+  }
+  vk::Queue getQueue(uint32_t family, uint32_t queueIndex = 0) const {
+    return instance.getQueue(family, queueIndex);
+  }
+
+  // This function will return a empty Queue if the type is invalid.
+  vk::Queue getQueue(QueueType type, uint32_t queueIndex = 0) const {
+    uint32_t family_index = get_queue_index(type);
+    if (family_index == QUEUE_INDEX_MAX_VALUE)
+      return vk::Queue();
+    return getQueue(family_index, queueIndex);
+  }
+  // Only a compute or transfer queue type is valid. All other queue types do
+  // not support a 'dedicated' queue
+  vk::Queue get_dedicated_queue(QueueType type, uint32_t queueIndex = 0) const {
+    uint32_t family_index = get_dedicated_queue_index(type);
+    if (family_index == QUEUE_INDEX_MAX_VALUE)
+      return vk::Queue();
+    return getQueue(family_index, queueIndex);
+  }
+
+  vk::CommandPool createCommandPool(QueueType qt = QueueType::graphics) {
+    vk::CommandPoolCreateInfo pool_info = {};
+    pool_info.queueFamilyIndex = get_queue_index(qt);
+    pool_info.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    return instance.createCommandPool(pool_info, allocation_callbacks);
+  }
+
+  std::vector<vk::CommandBuffer> createCommandBuffers(vk::CommandPool pool, uint32_t count = 1) {
+    vk::CommandBufferAllocateInfo allocInfo = {};
+    allocInfo.commandPool                 = pool;
+    allocInfo.level                       = vk::CommandBufferLevel::ePrimary;
+    allocInfo.commandBufferCount          = count;
+
+    return instance.allocateCommandBuffers(allocInfo);
+  }
+
+  // create* make new objects, the pooled acquire* below recycle them.
+  vk::Semaphore createSemaphore() {
+    vk::SemaphoreCreateInfo semaphore_info = {};
+    return instance.createSemaphore(semaphore_info);
+  }
+
+  std::vector<vk::Semaphore> createSemaphores(uint32_t count) {
+    std::vector<vk::Semaphore> semaphores(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      semaphores[i] = createSemaphore();
+    }
+    return semaphores;
+  }
+
+  vk::Fence createFence() {
+    vk::FenceCreateInfo fence_info = {};
+    fence_info.flags = vk::FenceCreateFlagBits::eSignaled;
+    return instance.createFence(fence_info);
+  }
+
+  std::vector<vk::Fence> createFences(uint32_t count) {
+    std::vector<vk::Fence> fences(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      fences[i] = createFence();
+    }
+    return fences;
+  }
+
+  // Unsignaled fences from the pool, give them back with releaseFences.
+  std::vector<vk::Fence> acquireFences(uint32_t count) {
+    return fences->acquire(count);
+  }
+
+  void releaseFences(const std::vector<vk::Fence> &released) {
+    fences->release(released);
+  }
+
+  // Binary semaphores from the pool, give them back with releaseSemaphores,
+  // or retireSemaphores while frames in flight may still use them.
+  std::vector<vk::Semaphore> acquireSemaphores(uint32_t count) {
+    return semaphores->acquire(count);
+  }
+
+  void releaseSemaphores(const std::vector<vk::Semaphore> &released) {
+    semaphores->release(released);
+  }
+
+  // Return the semaphores to the pool once the GPU work submitted so far
+  // has completed.
+  void retireSemaphores(const std::vector<vk::Semaphore> &retired) {
+    if (retired.empty())
+      return;
+    auto pool = semaphores;
+    deletion->retire([pool, retired]() { pool->release(retired); });
+  }
+  
+  void destroy() {
+    if (deletion) deletion->destroy();
+    if (pipeline_cache) pipeline_cache->destroy();
+    if (layouts) layouts->destroy();
+    if (shaders) shaders->destroy();
+    if (staging) staging->destroy();
+    if (transfer) transfer->destroy();
+    if (compute) compute->destroy();
+    if (immediate) immediate->destroy();
+    if (allocator) allocator->destroy();
+    if (queues) queues->destroy();
+    if (fences) fences->destroy();
+    if (semaphores) semaphores->destroy();
+    instance.destroy(allocation_callbacks);
+  }
+};
+
+// For advanced device queue setup
+struct CustomQueueDescription {
+  explicit CustomQueueDescription(uint32_t index, uint32_t count,
+                                  std::vector<float> priorities)
+      : index(index), count(count), priorities(priorities) {
+    assert(count == priorities.size());
+  }
+  uint32_t index = 0;
+  uint32_t count = 0;
+  std::vector<float> priorities;
+};
+
+class DeviceBuilder {
+public:
+  // Any features and extensions that are requested/required in
+  // PhysicalDeviceSelector are automatically enabled.
+  DeviceBuilder(PhysicalDevice phys_device) {
+    info.physical_device = phys_device;
+    info.surface = phys_device.surface;
+    info.queue_families = phys_device.queue_families;
+    info.features = phys_device.features;
+    info.extensions_to_enable = phys_device.extensions_to_enable;
+    info.defer_surface_initialization =
+        phys_device.defer_surface_initialization;
+  }
+
+  // For Advanced Users: specify the exact list of VkDeviceQueueCreateInfo's
+  // needed for the application. If a custom queue setup is provided, getting
+  // the queues and queue indexes is up to the application.
+  DeviceBuilder &
+  custom_queue_setup(std::vector<CustomQueueDescription> queue_descriptions) {
+    info.queue_descriptions = queue_descriptions;
+    return *this;
+  }
+
+  // Add a structure to the pNext chain of VkDeviceCreateInfo.
+  // The structure must be valid when DeviceBuilder::build() is called.
+  template <typename T> DeviceBuilder &add_pNext(T *structure) {
+    info.pNext_chain.push_back(
+        reinterpret_cast<vk::BaseOutStructure *>(structure));
+    return *this;
+  }
+
+  // Provide custom allocation callbacks.
+  DeviceBuilder &set_allocation_callbacks(vk::Optional<const vk::AllocationCallbacks> callbacks) {
+    info.allocation_callbacks = callbacks;
+    return *this;
+  }
+
+  // Size of the vk::DeviceMemory blocks the device's MemoryAllocator carves
+  // buffers and images out of. Defaults to 64MB.
+  DeviceBuilder &set_memory_block_size(vk::DeviceSize size) {
+    info.memory_block_size = size;
+    return *this;
+  }
+
+  // Size of the persistently mapped ring that GenericBuffer::upload and
+  // GenericImage::upload stage through. Defaults to 32MB, larger uploads
+  // throw.
+  DeviceBuilder &set_staging_ring_size(vk::DeviceSize size) {
+    info.staging_ring_size = size;
+    return *this;
+  }
+
+  // File the device's PipelineCache is loaded from and saved to. Without a
+  // path the cache only lives as long as the device.
+  DeviceBuilder &set_pipeline_cache_path(std::string path) {
+    info.pipeline_cache_path = std::move(path);
+    return *this;
+  }
+
+  // Load a device level dispatch table through vkGetDeviceProcAddr. Calls
+  // made with Device::dispatch() then jump straight into the driver instead
+  // of going through the loader trampolines of the global dispatcher.
+  DeviceBuilder &use_device_dispatch(bool enable = true) {
+    info.device_dispatch = enable;
+    return *this;
+  }
+
+  // Back the queue timelines with timeline semaphores, from Vulkan 1.2 or
+  // VK_KHR_timeline_semaphore, when the device supports them. Otherwise the
+  // timelines fall back to recycled fences.
+  DeviceBuilder &use_timeline_semaphores(bool enable = true) {
+    info.timeline_semaphores = enable;
+    return *this;
+  }
+
+  // Enable vkCmdDrawIndirectCount and vkCmdDrawIndexedIndirectCount, from
+  // VK_KHR_draw_indirect_count or the Vulkan 1.2 drawIndirectCount feature,
+  // when the device supports them. See Device::draw_indirect_count.
+  DeviceBuilder &use_draw_indirect_count(bool enable = true) {
+    info.draw_indirect_count = enable;
+    return *this;
+  }
+
+  // Create every queue of every family instead of one per family, all with
+  // `priority`. Device::queues hands them out to submitting threads.
+  DeviceBuilder &request_all_queues(float priority = 1.0f) {
+    info.all_queues = true;
+    info.default_priority = priority;
+    return *this;
+  }
+
+  // Priorities of the queues created in `family`, one per queue. Creates
+  // priorities.size() queues (at most the family's queueCount).
+  DeviceBuilder &set_queue_priorities(uint32_t family, std::vector<float> priorities) {
+    info.family_priorities[family] = std::move(priorities);
+    return *this;
+  }
+
+  Device build() const {
+
+    std::vector<CustomQueueDescription> queue_descriptions;
+    queue_descriptions.insert(queue_descriptions.end(),
+                              info.queue_descriptions.begin(),
+                              info.queue_descriptions.end());
+
+    if (queue_descriptions.size() == 0) {
+      for (uint32_t i = 0; i < info.queue_families.families.size(); i++) {
+        uint32_t available = info.queue_families.families[i].queueCount;
+        std::vector<float> priorities{info.default_priority};
+        auto custom = info.family_priorities.find(i);
+        if (custom != info.family_priorities.end() && !custom->second.empty())
+          priorities = custom->second;
+        else if (info.all_queues)
+          priorities.assign(available, info.default_priority);
+        if (priorities.size() > available)
+          priorities.resize(available);
+        uint32_t count = static_cast<uint32_t>(priorities.size());
+        queue_descriptions.push_back(
+            CustomQueueDescription{i, count, priorities});
+      }
+    }
+
+    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos;
+    for (auto &desc : queue_descriptions) {
+      vk::DeviceQueueCreateInfo queue_create_info = {};
+      queue_create_info.queueFamilyIndex = desc.index;
+      queue_create_info.queueCount = desc.count;
+      queue_create_info.pQueuePriorities = desc.priorities.data();
+      queueCreateInfos.push_back(queue_create_info);
+    }
+
+    std::vector<const char *> extensions =
+        helper::strvec2c_str(info.extensions_to_enable);
+    if (info.surface || info.defer_surface_initialization)
+      extensions.push_back({VK_KHR_SWAPCHAIN_EXTENSION_NAME});
+
+    std::vector<vk::BaseOutStructure *> pNext_chain = info.pNext_chain;
+    // Before the timeline semaphores, which reuse a Vulkan12Features struct
+    // added here.
+    vk::PhysicalDeviceVulkan12Features vulkan12_features;
+    bool draw_indirect_count = info.draw_indirect_count &&
+        enable_draw_indirect_count(extensions, pNext_chain, vulkan12_features);
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timeline_features;
+    bool timeline_semaphores = info.timeline_semaphores &&
+        enable_timeline_semaphores(extensions, pNext_chain, timeline_features);
+
+    // VUID-VkDeviceCreateInfo-pNext-00373 - don't add pEnabledFeatures if the
+    // phys_dev_features_2 is present
+    bool has_phys_dev_features_2 = false;
+    for (auto &pNext_struct : pNext_chain) {
+      if (pNext_struct->sType == vk::StructureType::ePhysicalDeviceFeatures2) {
+        has_phys_dev_features_2 = true;
+      }
+    }
+
+    vk::DeviceCreateInfo device_create_info = {};
+    helper::setup_pNext_chain<vk::DeviceCreateInfo>(device_create_info,
+                                                    pNext_chain);
+    device_create_info.flags = info.flags;
+    device_create_info.queueCreateInfoCount =
+        static_cast<uint32_t>(queueCreateInfos.size());
+    device_create_info.pQueueCreateInfos = queueCreateInfos.data();
+    device_create_info.enabledExtensionCount =
+        static_cast<uint32_t>(extensions.size());
+    device_create_info.ppEnabledExtensionNames = extensions.data();
+    if (!has_phys_dev_features_2) {
+      device_create_info.pEnabledFeatures = &info.features;
+    }
+    Device device;
+    auto vkdev = info.physical_device->createDevice(
+        device_create_info, info.allocation_callbacks);
+    if (!vkdev) {
+      throw std::runtime_error("Device create failed");
+    }
+    device.instance = vkdev;
+    device.physical_device = info.physical_device;
+    device.surface = info.surface;
+    device.queue_families = info.queue_families;
+    device.draw_indirect_count = draw_indirect_count;
+    device.allocation_callbacks = info.allocation_callbacks;
+    if (info.device_dispatch) {
+      device.dispatch_table = std::make_shared<vk::DispatchLoaderDynamic>(VULKAN_HPP_DEFAULT_DISPATCHER);
+      device.dispatch_table->init(vkdev);
+    }
+    device.allocator = std::make_shared<MemoryAllocator>(
+        vkdev, info.physical_device, info.memory_block_size,
+        info.allocation_callbacks);
+    device.staging = std::make_shared<StagingRing>(
+        vkdev, device.allocator, info.staging_ring_size,
+        info.allocation_callbacks);
+    device.pipeline_cache = std::make_shared<PipelineCache>(
+        vkdev, info.physical_device, info.pipeline_cache_path,
+        info.allocation_callbacks);
+    device.layouts = std::make_shared<LayoutCache>(vkdev, info.allocation_callbacks);
+    device.shaders = std::make_shared<ShaderRegistry>(vkdev, info.allocation_callbacks);
+    device.fences = std::make_shared<FencePool>(
+        vkdev, info.allocation_callbacks, device.dispatch_table);
+    device.semaphores = std::make_shared<SemaphorePool>(
+        vkdev, info.allocation_callbacks, device.dispatch_table);
+    std::vector<std::vector<std::shared_ptr<QueueTimeline>>> queues(
+        info.queue_families.families.size());
+    for (auto &desc : queue_descriptions) {
+      if (desc.index >= queues.size() || !queues[desc.index].empty())
+        continue;
+      for (uint32_t q = 0; q < desc.count; ++q)
+        queues[desc.index].push_back(std::make_shared<QueueTimeline>(
+            vkdev, desc.index, device.getQueue(desc.index, q), timeline_semaphores,
+            info.allocation_callbacks, device.dispatch_table));
+    }
+    device.timelines.resize(queues.size());
+    for (size_t i = 0; i < queues.size(); ++i)
+      if (!queues[i].empty())
+        device.timelines[i] = queues[i][0];
+    device.queues = std::make_shared<QueueManager>(std::move(queues));
+    device.deletion = std::make_shared<DeletionQueue>(
+        vkdev, device.queues->all(), info.allocation_callbacks, device.dispatch_table);
+    uint32_t graphics = device.get_queue_index(QueueType::graphics);
+    if (graphics < device.timelines.size() && device.timelines[graphics]) {
+      device.immediate = std::make_shared<ImmediateContext>(
+          vkdev, device.timelines[graphics], info.allocation_callbacks);
+
+      // Prefer a transfer only family, then any family apart from graphics.
+      uint32_t transfer = device.get_dedicated_queue_index(QueueType::transfer);
+      if (transfer >= device.timelines.size() || !device.timelines[transfer])
+        transfer = device.get_queue_index(QueueType::transfer);
+      if (transfer >= device.timelines.size() || !device.timelines[transfer])
+        transfer = graphics;
+      device.transfer = std::make_shared<TransferEngine>(
+          vkdev, device.staging, device.timelines[transfer],
+          device.timelines[graphics], info.allocation_callbacks);
+
+      uint32_t compute = device.get_dedicated_queue_index(QueueType::compute);
+      if (compute >= device.timelines.size() || !device.timelines[compute])
+        compute = device.get_queue_index(QueueType::compute);
+      if (compute >= device.timelines.size() || !device.timelines[compute])
+        compute = graphics;
+      device.compute = std::make_shared<ComputeContext>(
+          vkdev, device.timelines[compute], device.timelines[graphics],
+          info.allocation_callbacks);
+    }
+    return device;
+  }
+
+private:
+  // Add the extension and feature struct needed for timeline semaphores.
+  // Returns false if the device can't provide them.
+  bool enable_timeline_semaphores(std::vector<const char *> &extensions,
+                                  std::vector<vk::BaseOutStructure *> &pNext_chain,
+                                  vk::PhysicalDeviceTimelineSemaphoreFeatures &features) const {
+    if (!VULKAN_HPP_DEFAULT_DISPATCHER.vkGetPhysicalDeviceFeatures2)
+      return false;
+
+    bool has_extension = false;
+    for (auto &ext : info.physical_device->enumerateDeviceExtensionProperties()) {
+      if (strcmp(ext.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0)
+        has_extension = true;
+    }
+    bool core = info.physical_device.properties.apiVersion >= VK_API_VERSION_1_2;
+    if (!has_extension && !core)
+      return false;
+
+    vk::PhysicalDeviceTimelineSemaphoreFeatures query;
+    vk::PhysicalDeviceFeatures2 features2;
+    features2.pNext = &query;
+    info.physical_device->getFeatures2(&features2);
+    if (!query.timelineSemaphore)
+      return false;
+
+    if (has_extension) {
+      bool listed = false;
+      for (auto name : extensions)
+        listed = listed || strcmp(name, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0;
+      if (!listed)
+        extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+    }
+
+    // Reuse a feature struct the application already chained in.
+    for (auto structure : pNext_chain) {
+      if (structure->sType == vk::StructureType::ePhysicalDeviceVulkan12Features) {
+        reinterpret_cast<vk::PhysicalDeviceVulkan12Features *>(structure)->timelineSemaphore = true;
+        return true;
+      }
+      if (structure->sType == vk::StructureType::ePhysicalDeviceTimelineSemaphoreFeatures) {
+        reinterpret_cast<vk::PhysicalDeviceTimelineSemaphoreFeatures *>(structure)->timelineSemaphore = true;
+        return true;
+      }
+    }
+    features.timelineSemaphore = true;
+    pNext_chain.push_back(reinterpret_cast<vk::BaseOutStructure *>(&features));
+    return true;
+  }
+
+  // Add the extension or feature needed for the indirect count draws.
+  // Returns false if the device can't provide them.
+  bool enable_draw_indirect_count(std::vector<const char *> &extensions,
+                                  std::vector<vk::BaseOutStructure *> &pNext_chain,
+                                  vk::PhysicalDeviceVulkan12Features &features) const {
+    bool has_extension = false;
+    for (auto &ext : info.physical_device->enumerateDeviceExtensionProperties()) {
+      if (strcmp(ext.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0)
+        has_extension = true;
+    }
+    if (has_extension) {
+      bool listed = false;
+      for (auto name : extensions)
+        listed = listed || strcmp(name, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0;
+      if (!listed)
+        extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+      return true;
+    }
+
+    if (info.physical_device.properties.apiVersion < VK_API_VERSION_1_2 ||
+        !VULKAN_HPP_DEFAULT_DISPATCHER.vkGetPhysicalDeviceFeatures2)
+      return false;
+    vk::PhysicalDeviceVulkan12Features query;
+    vk::PhysicalDeviceFeatures2 features2;
+    features2.pNext = &query;
+    info.physical_device->getFeatures2(&features2);
+    if (!query.drawIndirectCount)
+      return false;
+
+    for (auto structure : pNext_chain) {
+      if (structure->sType == vk::StructureType::ePhysicalDeviceVulkan12Features) {
+        reinterpret_cast<vk::PhysicalDeviceVulkan12Features *>(structure)->drawIndirectCount = true;
+        return true;
+      }
+    }
+    features.drawIndirectCount = true;
+    pNext_chain.push_back(reinterpret_cast<vk::BaseOutStructure *>(&features));
+    return true;
+  }
+
+  struct DeviceInfo {
     vk::DeviceCreateFlags flags;
     std::vector<vk::BaseOutStructure *> pNext_chain;
     PhysicalDevice physical_device;
@@ -1431,6 +4456,15 @@ private:
     std::vector<std::string> extensions_to_enable;
     std::vector<CustomQueueDescription> queue_descriptions;
     vk::Optional<const vk::AllocationCallbacks> allocation_callbacks = nullptr;
+    vk::DeviceSize memory_block_size = MemoryAllocator::default_block_size;
+    vk::DeviceSize staging_ring_size = StagingRing::default_capacity;
+    std::string pipeline_cache_path;
+    bool device_dispatch = false;
+    bool timeline_semaphores = false;
+    bool draw_indirect_count = false;
+    bool all_queues = false;
+    float default_priority = 1.0f;
+    std::map<uint32_t, std::vector<float>> family_priorities;
   } info;
 };
 
@@ -2077,6 +5111,23 @@ public:
   }
 
   vk::Pipeline build(vk::RenderPass render_pass, uint32_t subpass = 0) {
+    const vk::GraphicsPipelineCreateInfo &pipeline_info = prepare(render_pass, subpass);
+
+    vk::PipelineCache cache = device.pipeline_cache ? device.pipeline_cache->get() : vk::PipelineCache();
+    auto result = device->createGraphicsPipeline(cache, pipeline_info);
+    if (result.result != vk::Result::eSuccess)
+      throw std::runtime_error("failed_create_graphics_pipeline");
+    return result.value;
+  }
+
+  // Resolve the defaults and fill the create info without creating the
+  // pipeline. Everything the returned info points to is held by this
+  // builder, so it stays valid until the builder is modified or destroyed.
+  const vk::GraphicsPipelineCreateInfo &prepare(vk::RenderPass render_pass, uint32_t subpass = 0) {
+    for (auto &stage : shader_stages)
+      if (stage.stage == vk::ShaderStageFlagBits::eCompute)
+        throw std::runtime_error("compute_stage_in_graphics_pipeline");
+
     if (use_default_input_state) setVertexInputState(VertexInputStateBuilder().build());
     else if (use_input_state_builder) setVertexInputState(input_state_builder.build());
     
@@ -2087,22 +5138,19 @@ public:
     if (use_default_multisampling) setMultisampler();
     if (use_default_color_blending) setColorBlending();
 
-    vk::PipelineDynamicStateCreateInfo dynamic_info;
+    dynamic_info = vk::PipelineDynamicStateCreateInfo();
     dynamic_info.dynamicStateCount = static_cast<uint32_t>(dynamic_states.size());
     dynamic_info.pDynamicStates    = dynamic_states.data();
 
-    vk::PipelineLayoutCreateInfo pipeline_layout_info;
-    pipeline_layout_info.setLayoutCount         = 0;
-    pipeline_layout_info.pushConstantRangeCount = 0;
-    vk::PipelineLayout layout = device->createPipelineLayout(pipeline_layout_info);
+    layout = device.layouts->getPipelineLayout(set_layouts, push_constant_ranges);
 
-    vk::PipelineViewportStateCreateInfo viewport_state;
+    viewport_state = vk::PipelineViewportStateCreateInfo();
     viewport_state.viewportCount = viewports.size();
     viewport_state.pViewports    = viewports.data();
     viewport_state.scissorCount  = scissors.size();
     viewport_state.pScissors     = scissors.data();
 
-    vk::GraphicsPipelineCreateInfo pipeline_info;
+    pipeline_info = vk::GraphicsPipelineCreateInfo();
     pipeline_info.stageCount          = shader_stages.size();
     pipeline_info.pStages             = shader_stages.data();
     pipeline_info.pVertexInputState   = &input_state;
@@ -2115,16 +5163,39 @@ public:
     pipeline_info.layout              = layout;
     pipeline_info.renderPass          = render_pass;
     pipeline_info.subpass             = subpass;
+    return pipeline_info;
+  }
 
-    auto result = device->createGraphicsPipeline(nullptr, pipeline_info);
-    if (result.result != vk::Result::eSuccess)
-      throw std::runtime_error("failed_create_graphics_pipeline");
-    return result.value;
+  // Descriptor set layouts in set order. The pipeline layout is taken from
+  // the device's LayoutCache and is owned by the device.
+  PipelineBuilder& addDescriptorSetLayout(vk::DescriptorSetLayout set_layout) {
+    set_layouts.push_back(set_layout);
+    return *this;
+  }
+
+  PipelineBuilder& addPushConstantRange(vk::ShaderStageFlags stages, uint32_t offset, uint32_t size) {
+    push_constant_ranges.emplace_back(stages, offset, size);
+    return *this;
+  }
+
+  // The layout of the last built pipeline, for binding descriptor sets and
+  // pushing constants.
+  vk::PipelineLayout getLayout() const {
+    return layout;
   }
 
+  // The modules come from the device's ShaderRegistry, identical code is
+  // only turned into a module once.
   PipelineBuilder& useClassicPipeline(const std::vector<uint32_t>& vert, const std::vector<uint32_t>& frag) {
-    vk::ShaderModule vert_module = createShaderModule(device, vert);
-    vk::ShaderModule frag_module = createShaderModule(device, frag);
+    vk::ShaderModule vert_module = device.shaders->get(vert);
+    vk::ShaderModule frag_module = device.shaders->get(frag);
+    return useClassicPipeline(vert_module, frag_module);
+  }
+
+  // Load SPIR-V files through the device's ShaderRegistry.
+  PipelineBuilder& useClassicPipeline(const std::string& vert_path, const std::string& frag_path) {
+    vk::ShaderModule vert_module = device.shaders->load(vert_path);
+    vk::ShaderModule frag_module = device.shaders->load(frag_path);
     return useClassicPipeline(vert_module, frag_module);
   }
 
@@ -2180,6 +5251,8 @@ public:
     return *this;
   }
 
+  // Kept for source compatibility only, build() and prepare() throw when a
+  // compute stage was added. Use ComputePipelineBuilder for compute pipelines.
   PipelineBuilder& addComputeStage(vk::ShaderModule compute_module, std::string pName = "main") {
     shader_entry_names.push_back(pName);
 
@@ -2360,23 +5433,750 @@ private:
   bool use_default_scissor = true;
   std::vector<vk::Rect2D> scissors;
 
-  bool use_default_rasterizer = true;
-  vk::PipelineRasterizationStateCreateInfo rasterizer;
+  bool use_default_rasterizer = true;
+  vk::PipelineRasterizationStateCreateInfo rasterizer;
+
+  bool use_default_multisampling = true;
+  vk::PipelineMultisampleStateCreateInfo multisampling;
+
+  bool use_default_color_blending = true;
+  vk::PipelineColorBlendAttachmentState colorBlendAttachment;
+  vk::PipelineColorBlendStateCreateInfo color_blending;
+
+  std::vector<vk::DescriptorSetLayout> set_layouts;
+  std::vector<vk::PushConstantRange> push_constant_ranges;
+
+  // Filled by prepare().
+  vk::PipelineDynamicStateCreateInfo dynamic_info;
+  vk::PipelineLayout layout;
+  vk::PipelineViewportStateCreateInfo viewport_state;
+  vk::GraphicsPipelineCreateInfo pipeline_info;
+};
+
+// Compiles many configured PipelineBuilders at once. The builders are
+// prepared on the calling thread, then split into chunks which worker
+// threads pass to a single createGraphicsPipelines call each. All of them
+// go through the device's PipelineCache.
+class PipelineBatchBuilder {
+public:
+  struct Result {
+    vk::Pipeline pipeline;  // null if the pipeline failed
+    vk::Result result = vk::Result::eSuccess;
+    std::string error;
+
+    explicit operator bool() const { return bool(pipeline); }
+  };
+
+  PipelineBatchBuilder(const Device &device) : device(device) {}
+
+  // The builder is referenced, not copied, and must outlive build().
+  PipelineBatchBuilder& add(PipelineBuilder &builder, vk::RenderPass render_pass, uint32_t subpass = 0) {
+    entries.push_back({&builder, render_pass, subpass});
+    return *this;
+  }
+
+  // Threads used by build(), including the calling one. 0 (the default)
+  // uses one per core. Ignored when a thread pool is given.
+  PipelineBatchBuilder& set_thread_count(uint32_t count) {
+    thread_count = count;
+    return *this;
+  }
+
+  // Run on an existing pool instead of starting threads for this batch.
+  PipelineBatchBuilder& set_thread_pool(helper::ThreadPool *pool) {
+    this->pool = pool;
+    return *this;
+  }
+
+  // Pipelines per createGraphicsPipelines call. 0 (the default) splits the
+  // batch into a few chunks per thread.
+  PipelineBatchBuilder& set_chunk_size(uint32_t size) {
+    chunk_size = size;
+    return *this;
+  }
+
+  size_t size() const { return entries.size(); }
+
+  // Returns one Result per add(), in the same order. Failures are reported
+  // per pipeline instead of throwing.
+  std::vector<Result> build() {
+    std::vector<Result> results(entries.size());
+    std::vector<vk::GraphicsPipelineCreateInfo> infos(entries.size());
+    std::vector<size_t> prepared;
+    prepared.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      try {
+        infos[prepared.size()] = entries[i].builder->prepare(entries[i].render_pass, entries[i].subpass);
+        prepared.push_back(i);
+      } catch (const std::exception &e) {
+        results[i].result = vk::Result::eErrorUnknown;
+        results[i].error = e.what();
+      }
+    }
+    if (prepared.empty())
+      return results;
+
+    std::unique_ptr<helper::ThreadPool> local_pool;
+    helper::ThreadPool *threads = pool;
+    if (!threads) {
+      local_pool.reset(new helper::ThreadPool(thread_count));
+      threads = local_pool.get();
+    }
+
+    size_t chunk = chunk_size;
+    if (chunk == 0) {
+      size_t parts = size_t(threads->size()) * 4;
+      chunk = std::max<size_t>(1, (prepared.size() + parts - 1) / parts);
+    }
+    size_t chunk_count = (prepared.size() + chunk - 1) / chunk;
+
+    vk::PipelineCache cache = device.pipeline_cache ? device.pipeline_cache->get() : vk::PipelineCache();
+    const vk::AllocationCallbacks *callbacks = device.allocation_callbacks;
+    std::vector<vk::Pipeline> pipelines(prepared.size());
+    std::vector<vk::Result> chunk_results(chunk_count, vk::Result::eSuccess);
+
+    threads->parallel_for(chunk_count, [&](size_t c) {
+      size_t first = c * chunk;
+      uint32_t count = static_cast<uint32_t>(std::min(chunk, prepared.size() - first));
+      chunk_results[c] = device->createGraphicsPipelines(
+          cache, count, infos.data() + first, callbacks, pipelines.data() + first);
+    });
+
+    for (size_t k = 0; k < prepared.size(); ++k) {
+      Result &r = results[prepared[k]];
+      r.pipeline = pipelines[k];
+      if (!r.pipeline) {
+        r.result = chunk_results[k / chunk];
+        if (r.result == vk::Result::eSuccess)
+          r.result = vk::Result::eErrorUnknown;
+        r.error = "failed_create_graphics_pipeline: " + vk::to_string(r.result);
+      }
+    }
+    return results;
+  }
+
+private:
+  struct Entry {
+    PipelineBuilder *builder;
+    vk::RenderPass render_pass;
+    uint32_t subpass;
+  };
+
+  Device const& device;
+  std::vector<Entry> entries;
+  uint32_t thread_count = 0;
+  uint32_t chunk_size = 0;
+  helper::ThreadPool *pool = nullptr;
+};
+
+// Builds compute pipelines. Layouts come from the device's LayoutCache and
+// the pipeline is created through its PipelineCache. Dispatch with
+// Device::compute.
+class ComputePipelineBuilder {
+public:
+  ComputePipelineBuilder(const Device &device) : device(device) {}
+
+  ComputePipelineBuilder& setShader(vk::ShaderModule module, std::string pName = "main") {
+    this->module = module;
+    entry_name = pName;
+    return *this;
+  }
+
+  // Load the SPIR-V file through the device's ShaderRegistry.
+  ComputePipelineBuilder& setShader(const std::string& path, std::string pName = "main") {
+    return setShader(device.shaders->load(path), pName);
+  }
+
+  ComputePipelineBuilder& setShader(const std::vector<uint32_t>& code, std::string pName = "main") {
+    return setShader(device.shaders->get(code), pName);
+  }
+
+  ComputePipelineBuilder& setSpecializationInfo(const vk::SpecializationInfo& info) {
+    specialization = info;
+    use_specialization = true;
+    return *this;
+  }
+
+  ComputePipelineBuilder& addDescriptorSetLayout(vk::DescriptorSetLayout set_layout) {
+    set_layouts.push_back(set_layout);
+    return *this;
+  }
+
+  ComputePipelineBuilder& addPushConstantRange(uint32_t offset, uint32_t size) {
+    push_constant_ranges.emplace_back(vk::ShaderStageFlagBits::eCompute, offset, size);
+    return *this;
+  }
+
+  vk::Pipeline build() {
+    if (!module)
+      throw std::runtime_error("compute_shader_not_set");
+    layout = device.layouts->getPipelineLayout(set_layouts, push_constant_ranges);
+
+    vk::ComputePipelineCreateInfo pipeline_info;
+    pipeline_info.stage.stage = vk::ShaderStageFlagBits::eCompute;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = entry_name.c_str();
+    pipeline_info.stage.pSpecializationInfo = use_specialization ? &specialization : nullptr;
+    pipeline_info.layout = layout;
+
+    vk::PipelineCache cache = device.pipeline_cache ? device.pipeline_cache->get() : vk::PipelineCache();
+    auto result = device->createComputePipeline(cache, pipeline_info, device.allocation_callbacks);
+    if (result.result != vk::Result::eSuccess)
+      throw std::runtime_error("failed_create_compute_pipeline");
+    return result.value;
+  }
+
+  // The layout of the last built pipeline.
+  vk::PipelineLayout getLayout() const {
+    return layout;
+  }
+
+private:
+  Device const& device;
+  vk::ShaderModule module;
+  std::string entry_name = "main";
+  vk::SpecializationInfo specialization;
+  bool use_specialization = false;
+  std::vector<vk::DescriptorSetLayout> set_layouts;
+  std::vector<vk::PushConstantRange> push_constant_ranges;
+  vk::PipelineLayout layout;
+};
+
+
+#pragma endregion
+
+#pragma region Present
+
+// Wraps a command buffer and remembers the bound pipelines, vertex and
+// index buffers, descriptor sets, push constants and dynamic state, so
+// binds that would not change anything are skipped instead of reaching the
+// driver. Counts issued and elided binds.
+//
+// Binding a pipeline keeps the tracked dynamic state, pass
+// `keeps_dynamic_state = false` for pipelines that set viewport or scissor
+// statically. Binding descriptor sets or pushing constants with a
+// different pipeline layout forgets what was tracked for the old one.
+class CommandRecorder {
+public:
+  struct Stats {
+    uint64_t binds = 0;   // state changes sent to the driver
+    uint64_t elided = 0;  // redundant ones skipped
+    uint64_t draws = 0;
+  };
+
+  CommandRecorder(vk::CommandBuffer cb,
+                  const vk::DispatchLoaderDynamic &d = VULKAN_HPP_DEFAULT_DISPATCHER)
+      : cb(cb), d(&d) {}
+
+  // Start over on another command buffer, nothing is bound in it yet.
+  void reset(vk::CommandBuffer cb) {
+    this->cb = cb;
+    forget();
+  }
+
+  // Forget the tracked state, e.g. after commands recorded on the raw
+  // command buffer or a render pass boundary.
+  void forget() {
+    points[0] = BindPoint();
+    points[1] = BindPoint();
+    vertex_buffers.clear();
+    index_buffer = vk::Buffer();
+    push_layout = vk::PipelineLayout();
+    push_constants.clear();
+    push_valid.clear();
+    viewport_set = false;
+    scissor_set = false;
+  }
+
+  CommandRecorder& bindPipeline(vk::PipelineBindPoint bind_point, vk::Pipeline pipeline,
+                                bool keeps_dynamic_state = true) {
+    BindPoint &point = get(bind_point);
+    if (point.pipeline == pipeline) {
+      stats.elided++;
+      return *this;
+    }
+    cb.bindPipeline(bind_point, pipeline, *d);
+    point.pipeline = pipeline;
+    if (!keeps_dynamic_state) {
+      viewport_set = false;
+      scissor_set = false;
+    }
+    stats.binds++;
+    return *this;
+  }
+
+  CommandRecorder& bindVertexBuffers(uint32_t first_binding,
+                                     const std::vector<vk::Buffer> &buffers,
+                                     const std::vector<vk::DeviceSize> &offsets) {
+    // Only the range from the first changed binding is sent.
+    uint32_t count = static_cast<uint32_t>(buffers.size());
+    uint32_t first_changed = count;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t binding = first_binding + i;
+      vk::DeviceSize offset = i < offsets.size() ? offsets[i] : 0;
+      if (binding >= vertex_buffers.size() || vertex_buffers[binding].buffer != buffers[i] ||
+          vertex_buffers[binding].offset != offset) {
+        first_changed = i;
+        break;
+      }
+    }
+    if (first_changed == count) {
+      stats.elided++;
+      return *this;
+    }
+
+    std::vector<vk::DeviceSize> sent_offsets(count - first_changed, 0);
+    for (uint32_t i = first_changed; i < count; ++i)
+      sent_offsets[i - first_changed] = i < offsets.size() ? offsets[i] : 0;
+    cb.bindVertexBuffers(first_binding + first_changed, count - first_changed,
+                         buffers.data() + first_changed, sent_offsets.data(), *d);
+    if (vertex_buffers.size() < first_binding + count)
+      vertex_buffers.resize(first_binding + count);
+    for (uint32_t i = first_changed; i < count; ++i)
+      vertex_buffers[first_binding + i] = {buffers[i], sent_offsets[i - first_changed]};
+    stats.binds++;
+    return *this;
+  }
+
+  CommandRecorder& bindVertexBuffer(uint32_t binding, vk::Buffer buffer, vk::DeviceSize offset = 0) {
+    return bindVertexBuffers(binding, {buffer}, {offset});
+  }
+
+  CommandRecorder& bindIndexBuffer(vk::Buffer buffer, vk::DeviceSize offset = 0,
+                                   vk::IndexType type = vk::IndexType::eUint32) {
+    if (index_buffer == buffer && index_offset == offset && index_type == type) {
+      stats.elided++;
+      return *this;
+    }
+    cb.bindIndexBuffer(buffer, offset, type, *d);
+    index_buffer = buffer;
+    index_offset = offset;
+    index_type = type;
+    stats.binds++;
+    return *this;
+  }
+
+  CommandRecorder& bindDescriptorSets(vk::PipelineBindPoint bind_point, vk::PipelineLayout layout,
+                                      uint32_t first_set, const std::vector<vk::DescriptorSet> &sets,
+                                      const std::vector<uint32_t> &dynamic_offsets = {}) {
+    BindPoint &point = get(bind_point);
+    if (point.layout != layout) {
+      point.layout = layout;
+      point.sets.clear();
+    }
+    // Sets with dynamic offsets are always rebound, the offsets are not
+    // tracked per set.
+    bool same = dynamic_offsets.empty() && first_set + sets.size() <= point.sets.size() &&
+                std::equal(sets.begin(), sets.end(), point.sets.begin() + first_set);
+    if (same) {
+      stats.elided++;
+      return *this;
+    }
+    cb.bindDescriptorSets(bind_point, layout, first_set, static_cast<uint32_t>(sets.size()), sets.data(),
+                          static_cast<uint32_t>(dynamic_offsets.size()), dynamic_offsets.data(), *d);
+    if (point.sets.size() < first_set + sets.size())
+      point.sets.resize(first_set + sets.size());
+    std::copy(sets.begin(), sets.end(), point.sets.begin() + first_set);
+    if (!dynamic_offsets.empty())
+      for (size_t i = 0; i < sets.size(); ++i)
+        point.sets[first_set + i] = vk::DescriptorSet();
+    stats.binds++;
+    return *this;
+  }
+
+  // Push constants are compared byte for byte against the last values
+  // pushed with the same layout.
+  CommandRecorder& pushConstants(vk::PipelineLayout layout, vk::ShaderStageFlags stages,
+                                 uint32_t offset, uint32_t size, const void *values) {
+    if (push_layout != layout) {
+      push_layout = layout;
+      push_constants.clear();
+      push_valid.clear();
+    }
+    bool same = offset + size <= push_constants.size() &&
+                memcmp(push_constants.data() + offset, values, size) == 0;
+    for (uint32_t i = offset; same && i < offset + size; ++i)
+      same = push_valid[i];
+    if (same) {
+      stats.elided++;
+      return *this;
+    }
+    cb.pushConstants(layout, stages, offset, size, values, *d);
+    if (push_constants.size() < offset + size) {
+      push_constants.resize(offset + size);
+      push_valid.resize(offset + size, false);
+    }
+    memcpy(push_constants.data() + offset, values, size);
+    std::fill(push_valid.begin() + offset, push_valid.begin() + offset + size, true);
+    stats.binds++;
+    return *this;
+  }
+
+  template <class T>
+  CommandRecorder& pushConstants(vk::PipelineLayout layout, vk::ShaderStageFlags stages,
+                                 uint32_t offset, const T &value) {
+    return pushConstants(layout, stages, offset, sizeof(T), &value);
+  }
+
+  CommandRecorder& setViewport(const vk::Viewport &viewport) {
+    if (viewport_set && viewport == this->viewport) {
+      stats.elided++;
+      return *this;
+    }
+    cb.setViewport(0, 1, &viewport, *d);
+    this->viewport = viewport;
+    viewport_set = true;
+    stats.binds++;
+    return *this;
+  }
+
+  CommandRecorder& setScissor(const vk::Rect2D &scissor) {
+    if (scissor_set && scissor == this->scissor) {
+      stats.elided++;
+      return *this;
+    }
+    cb.setScissor(0, 1, &scissor, *d);
+    this->scissor = scissor;
+    scissor_set = true;
+    stats.binds++;
+    return *this;
+  }
+
+  CommandRecorder& draw(uint32_t vertex_count, uint32_t instance_count = 1,
+                        uint32_t first_vertex = 0, uint32_t first_instance = 0) {
+    cb.draw(vertex_count, instance_count, first_vertex, first_instance, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  CommandRecorder& drawIndexed(uint32_t index_count, uint32_t instance_count = 1,
+                               uint32_t first_index = 0, int32_t vertex_offset = 0,
+                               uint32_t first_instance = 0) {
+    cb.drawIndexed(index_count, instance_count, first_index, vertex_offset, first_instance, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  CommandRecorder& drawIndirect(vk::Buffer buffer, vk::DeviceSize offset, uint32_t draw_count,
+                                uint32_t stride = sizeof(vk::DrawIndirectCommand)) {
+    cb.drawIndirect(buffer, offset, draw_count, stride, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  CommandRecorder& drawIndexedIndirect(vk::Buffer buffer, vk::DeviceSize offset, uint32_t draw_count,
+                                       uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand)) {
+    cb.drawIndexedIndirect(buffer, offset, draw_count, stride, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  // The count variants need Device::draw_indirect_count. They use the core
+  // entry point when it is loaded and the KHR one otherwise.
+  CommandRecorder& drawIndirectCount(vk::Buffer buffer, vk::DeviceSize offset,
+                                     vk::Buffer count_buffer, vk::DeviceSize count_offset,
+                                     uint32_t max_draw_count,
+                                     uint32_t stride = sizeof(vk::DrawIndirectCommand)) {
+    if (d->vkCmdDrawIndirectCount)
+      cb.drawIndirectCount(buffer, offset, count_buffer, count_offset, max_draw_count, stride, *d);
+    else
+      cb.drawIndirectCountKHR(buffer, offset, count_buffer, count_offset, max_draw_count, stride, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  CommandRecorder& drawIndexedIndirectCount(vk::Buffer buffer, vk::DeviceSize offset,
+                                            vk::Buffer count_buffer, vk::DeviceSize count_offset,
+                                            uint32_t max_draw_count,
+                                            uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand)) {
+    if (d->vkCmdDrawIndexedIndirectCount)
+      cb.drawIndexedIndirectCount(buffer, offset, count_buffer, count_offset, max_draw_count, stride, *d);
+    else
+      cb.drawIndexedIndirectCountKHR(buffer, offset, count_buffer, count_offset, max_draw_count, stride, *d);
+    stats.draws++;
+    return *this;
+  }
+
+  CommandRecorder& dispatchCompute(uint32_t x, uint32_t y = 1, uint32_t z = 1) {
+    cb.dispatch(x, y, z, *d);
+    return *this;
+  }
+
+  // The raw command buffer, for anything not wrapped here. Call forget()
+  // after binding state through it.
+  vk::CommandBuffer get() const { return cb; }
+  const vk::DispatchLoaderDynamic &dispatch() const { return *d; }
+
+  const Stats &getStats() const { return stats; }
+  void resetStats() { stats = Stats(); }
+
+private:
+  struct VertexBinding {
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+  };
+
+  struct BindPoint {
+    vk::Pipeline pipeline;
+    vk::PipelineLayout layout;
+    std::vector<vk::DescriptorSet> sets;
+  };
+
+  BindPoint &get(vk::PipelineBindPoint bind_point) {
+    return bind_point == vk::PipelineBindPoint::eCompute ? points[1] : points[0];
+  }
+
+  vk::CommandBuffer cb;
+  const vk::DispatchLoaderDynamic *d;
+
+  BindPoint points[2];  // graphics, compute
+  std::vector<VertexBinding> vertex_buffers;
+  vk::Buffer index_buffer;
+  vk::DeviceSize index_offset = 0;
+  vk::IndexType index_type = vk::IndexType::eUint32;
+  vk::PipelineLayout push_layout;
+  std::vector<uint8_t> push_constants;
+  std::vector<bool> push_valid;
+  vk::Viewport viewport;
+  vk::Rect2D scissor;
+  bool viewport_set = false;
+  bool scissor_set = false;
+  Stats stats;
+};
+
+// One frame's draws as compact packets. Each packet names a pipeline, a
+// material (descriptor sets) and a mesh registered with the list, plus an
+// instance value, and carries a 64-bit sort key:
+//
+//   pass (8) | pipeline (16) | material (16) | order (24)
+//
+// `order` is a quantized depth (see depthOrder) for passes that need depth
+// ordering, and the mesh id otherwise, so equal meshes end up adjacent.
+// sort() radix sorts the packets by key and merges runs of the same
+// pipeline, material and mesh into one instanced draw. Instance i of a
+// merged draw is packet getInstanceIds()[firstInstance + i]: upload that
+// array and index it with gl_InstanceIndex (or bind it as an instance rate
+// vertex stream) to find the per-instance data.
+class DrawList {
+public:
+  struct Pipeline {
+    vk::Pipeline pipeline;
+    vk::PipelineLayout layout;
+  };
+
+  struct Material {
+    std::vector<vk::DescriptorSet> sets;
+    uint32_t first_set = 0;
+  };
+
+  // Indexed when index_buffer is set, `count` is then the index count.
+  struct Mesh {
+    vk::Buffer vertex_buffer;
+    vk::DeviceSize vertex_buffer_offset = 0;
+    vk::Buffer index_buffer;
+    vk::DeviceSize index_buffer_offset = 0;
+    vk::IndexType index_type = vk::IndexType::eUint32;
+    uint32_t count = 0;
+    uint32_t first = 0;
+    int32_t vertex_offset = 0;
+  };
+
+  struct Packet {
+    uint64_t key;
+    uint32_t pipeline;
+    uint32_t material;
+    uint32_t mesh;
+    uint32_t instance;
+  };
+
+  struct Draw {
+    uint32_t pipeline;
+    uint32_t material;
+    uint32_t mesh;
+    uint32_t first_instance;
+    uint32_t instance_count;
+  };
+
+  // State changes in submission order and after sorting and merging.
+  struct Stats {
+    size_t packets = 0;
+    size_t draws = 0;
+    size_t pipeline_changes_unsorted = 0;
+    size_t material_changes_unsorted = 0;
+    size_t mesh_changes_unsorted = 0;
+    size_t pipeline_changes = 0;
+    size_t material_changes = 0;
+    size_t mesh_changes = 0;
+  };
+
+  static uint64_t makeKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t order) {
+    return (uint64_t(pass & 0xff) << 56) | (uint64_t(pipeline & 0xffff) << 40) |
+           (uint64_t(material & 0xffff) << 24) | uint64_t(order & 0xffffff);
+  }
+
+  // 24-bit order for a depth in [0, 1], front to back unless
+  // `back_to_front` (transparent passes).
+  static uint32_t depthOrder(float depth, bool back_to_front = false) {
+    depth = std::min(std::max(depth, 0.0f), 1.0f);
+    uint32_t order = static_cast<uint32_t>(depth * float(0xffffff));
+    return back_to_front ? 0xffffff - order : order;
+  }
+
+  uint32_t addPipeline(vk::Pipeline pipeline, vk::PipelineLayout layout) {
+    pipelines.push_back({pipeline, layout});
+    return static_cast<uint32_t>(pipelines.size() - 1);
+  }
+
+  uint32_t addMaterial(std::vector<vk::DescriptorSet> sets, uint32_t first_set = 0) {
+    materials.push_back({std::move(sets), first_set});
+    return static_cast<uint32_t>(materials.size() - 1);
+  }
+
+  uint32_t addMesh(const Mesh &mesh) {
+    meshes.push_back(mesh);
+    return static_cast<uint32_t>(meshes.size() - 1);
+  }
+
+  void submit(const Packet &packet) {
+    packets.push_back(packet);
+    sorted = false;
+  }
+
+  // Packet with a key built by makeKey, ordered by mesh.
+  void submit(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh,
+              uint32_t instance) {
+    submit(Packet{makeKey(pass, pipeline, material, mesh), pipeline, material, mesh, instance});
+  }
+
+  // Drop the packets, the registered pipelines, materials and meshes stay.
+  void clear() {
+    packets.clear();
+    draws.clear();
+    instance_ids.clear();
+    sorted = true;
+    stats = Stats();
+  }
 
-  bool use_default_multisampling = true;
-  vk::PipelineMultisampleStateCreateInfo multisampling;
+  // Sort the packets and merge them into instanced draws.
+  void sort() {
+    if (sorted)
+      return;
+    stats = Stats();
+    stats.packets = packets.size();
+    count_changes(packets, stats.pipeline_changes_unsorted, stats.material_changes_unsorted,
+                  stats.mesh_changes_unsorted);
+
+    radix_sort();
+
+    draws.clear();
+    instance_ids.resize(packets.size());
+    for (size_t i = 0; i < packets.size(); ++i) {
+      const Packet &packet = packets[i];
+      instance_ids[i] = packet.instance;
+      if (!draws.empty()) {
+        Draw &last = draws.back();
+        if (last.pipeline == packet.pipeline && last.material == packet.material &&
+            last.mesh == packet.mesh) {
+          last.instance_count++;
+          continue;
+        }
+      }
+      draws.push_back({packet.pipeline, packet.material, packet.mesh, static_cast<uint32_t>(i), 1});
+    }
+    stats.draws = draws.size();
+    count_changes(draws, stats.pipeline_changes, stats.material_changes, stats.mesh_changes);
+    sorted = true;
+  }
+
+  // Sort if needed and record every draw. The recorder skips the binds
+  // that repeat.
+  void record(CommandRecorder &recorder) {
+    sort();
+    for (auto &draw : draws) {
+      const Pipeline &pipeline = pipelines[draw.pipeline];
+      const Material &material = materials[draw.material];
+      const Mesh &mesh = meshes[draw.mesh];
+      recorder.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.pipeline);
+      if (!material.sets.empty())
+        recorder.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipeline.layout,
+                                    material.first_set, material.sets);
+      if (mesh.vertex_buffer)
+        recorder.bindVertexBuffer(0, mesh.vertex_buffer, mesh.vertex_buffer_offset);
+      if (mesh.index_buffer) {
+        recorder.bindIndexBuffer(mesh.index_buffer, mesh.index_buffer_offset, mesh.index_type);
+        recorder.drawIndexed(mesh.count, draw.instance_count, mesh.first, mesh.vertex_offset,
+                             draw.first_instance);
+      } else {
+        recorder.draw(mesh.count, draw.instance_count, mesh.first, draw.first_instance);
+      }
+    }
+  }
 
-  bool use_default_color_blending = true;
-  vk::PipelineColorBlendAttachmentState colorBlendAttachment;
-  vk::PipelineColorBlendStateCreateInfo color_blending;
-};
+  const std::vector<Packet> &getPackets() const { return packets; }
+  const std::vector<Draw> &getDraws() const { return draws; }
+  const std::vector<uint32_t> &getInstanceIds() const { return instance_ids; }
+  const Stats &getStats() const { return stats; }
 
+private:
+  // LSD radix sort on the key, 8 bits per pass. Passes where every key has
+  // the same byte are skipped, so unused key fields cost nothing.
+  void radix_sort() {
+    size_t n = packets.size();
+    if (n < 2)
+      return;
+    scratch.resize(n);
+    std::vector<Packet> *src = &packets, *dst = &scratch;
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+      size_t counts[256] = {};
+      for (auto &packet : *src)
+        counts[(packet.key >> shift) & 0xff]++;
+      if (counts[(src->front().key >> shift) & 0xff] == n)
+        continue;
+      size_t offset = 0;
+      for (auto &count : counts) {
+        size_t c = count;
+        count = offset;
+        offset += c;
+      }
+      for (auto &packet : *src)
+        (*dst)[counts[(packet.key >> shift) & 0xff]++] = packet;
+      std::swap(src, dst);
+    }
+    if (src != &packets)
+      packets.swap(scratch);
+  }
 
-#pragma endregion
+  template <class T>
+  static void count_changes(const std::vector<T> &items, size_t &pipeline, size_t &material,
+                            size_t &mesh) {
+    for (size_t i = 0; i < items.size(); ++i) {
+      pipeline += i == 0 || items[i].pipeline != items[i - 1].pipeline;
+      material += i == 0 || items[i].material != items[i - 1].material;
+      mesh += i == 0 || items[i].mesh != items[i - 1].mesh;
+    }
+  }
 
-#pragma region Present
+  std::vector<Pipeline> pipelines;
+  std::vector<Material> materials;
+  std::vector<Mesh> meshes;
+
+  std::vector<Packet> packets;
+  std::vector<Packet> scratch;
+  std::vector<Draw> draws;
+  std::vector<uint32_t> instance_ids;
+  bool sorted = true;
+  Stats stats;
+};
 
 // Each thread should have a single struct for commands recording
+//
+// Frames are pipelined: up to `frames_in_flight` frames may be queued on the
+// GPU while the CPU records the next one. Command buffers come from
+// `command_pools`, which resets a slot's pools when the slot is reused.
+// Command buffers and acquire semaphores belong to a frame slot,
+// framebuffers and the render finished semaphores belong to a swapchain
+// image. Frames are paced on the graphics queue's timeline: every slot and
+// image remembers the timeline value of the last frame that used it.
 struct Present {
   Swapchain* swapchain = nullptr;
   Device* device = nullptr;
@@ -2387,40 +6187,113 @@ struct Present {
 
   vk::Queue graphics_queue;
   vk::Queue present_queue;
-
-  vk::CommandPool                command_pool;
+  std::shared_ptr<QueueTimeline> graphics_timeline;
+  std::shared_ptr<QueueTimeline> present_timeline;
+
+  uint32_t frames_in_flight = 2;
+  uint32_t frame_index = 0;  // frame slot being recorded
+  uint32_t image_index = 0;  // swapchain image acquired for this frame
+  // Presents made on the current swapchain.
+  uint32_t pending_presents = 0;
+
+  // Per thread and frame slot pools, see CommandPoolManager.
+  std::shared_ptr<CommandPoolManager> command_pools;
+  // Everything drawFrame() submits to the graphics queue, see submit().
+  std::shared_ptr<SubmitBatcher> submits;
+  // Command buffers replayed every frame, see executeCached().
+  std::shared_ptr<CommandCache> command_cache;
+  // Threads for recordParallel(), created on first use if not given.
+  std::shared_ptr<helper::ThreadPool> workers;
+  uint32_t recording_threads = 0;
+
+  // Indexed by frame slot.
   std::vector<vk::CommandBuffer> command_buffers;
-  std::vector<vk::Framebuffer>   framebuffers;
-
-  std::vector<vk::Fence> in_flight_fences;
-  std::vector<vk::Fence> image_in_flight;
+  std::vector<SubmitToken>       frame_values;
+  std::vector<vk::Semaphore>     available_semaphores;
 
-  std::vector<vk::Semaphore> available_semaphores;
-  std::vector<vk::Semaphore> finished_semaphore;
+  // Indexed by swapchain image.
+  std::vector<vk::Framebuffer>   framebuffers;
+  std::vector<SubmitToken>       image_values;
+  std::vector<vk::Semaphore>     finished_semaphore;
   vk::RenderPass render_pass;
+  uint32_t subpass = 0;  // subpass being recorded
+
+  // Extra waits for the next drawFrame() submission, see addWaitSemaphore.
+  std::vector<vk::Semaphore>          extra_wait_semaphores;
+  std::vector<uint64_t>               extra_wait_values;
+  std::vector<vk::PipelineStageFlags> extra_wait_stages;
 
   vk::CommandBuffer& getCurrentCommandBuffer() {
-    return command_buffers[swapchain->current_frame];
+    return command_buffers[frame_index];
   }
 
   vk::Framebuffer& getCurrentFrameBuffer() {
-    return framebuffers[swapchain->current_frame];
+    return framebuffers[image_index];
   }
 
+  // A state-tracking recorder for the current command buffer.
+  CommandRecorder getRecorder() {
+    return CommandRecorder(getCurrentCommandBuffer(), dispatch());
+  }
+
+  // Wait until the current frame slot is free, acquire the next swapchain
+  // image and start recording the slot's command buffer.
   void begin() {
-    vk::CommandBufferBeginInfo begin_info;
+    graphics_timeline->waitFor(getFrameValue());
+    device->deletion->collect();
+
+    command_pools->beginFrame(frame_index);
+    command_buffers[frame_index] = command_pools->allocate();
+
+    acquire();
+
+    // The image may still be in use by an older frame from another slot.
+    graphics_timeline->waitFor(getImageValue(image_index));
+
+    vk::CommandBufferBeginInfo begin_info{vk::CommandBufferUsageFlagBits::eOneTimeSubmit};
+
+    // Take ownership of everything the transfer queue uploaded meanwhile,
+    // in a command buffer ahead of everything submit() adds this frame.
+    if (device->transfer && device->transfer->hasPending()) {
+      vk::CommandBuffer acquire_cb = command_pools->allocate();
+      acquire_cb.begin(begin_info, dispatch());
+      auto wait = device->transfer->recordAcquire(acquire_cb);
+      acquire_cb.end(dispatch());
+      submits->add(acquire_cb, {wait});
+    }
+
     auto buffer = getCurrentCommandBuffer();
-    buffer.begin(begin_info);
+    buffer.begin(begin_info, dispatch());
+  }
+
+  // Make the next drawFrame() submission wait on `semaphore`, before any of
+  // the command buffers added with submit(). `value` is the value to wait
+  // for on a timeline semaphore, 0 for a binary one.
+  void addWaitSemaphore(vk::Semaphore semaphore, uint64_t value, vk::PipelineStageFlags stage) {
+    extra_wait_semaphores.push_back(semaphore);
+    extra_wait_values.push_back(value);
+    extra_wait_stages.push_back(stage);
   }
 
   void end() {
     auto buffer = getCurrentCommandBuffer();
-    buffer.end();
+    buffer.end(dispatch());
+  }
+
+  // Submit `cb` with this frame, ahead of the frame's own command buffer,
+  // in the same vkQueueSubmit. Allocate it from command_pools to have it
+  // recycled with the frame slot.
+  void submit(vk::CommandBuffer cb, const std::vector<TimelineWait> &waits = {}) {
+    submits->add(cb, waits);
   }
 
+  // Use vk::SubpassContents::eSecondaryCommandBuffers to record the pass
+  // with recordParallel().
   void beginRenderPass(vk::RenderPass render_pass, 
-    vk::ClearValue clearColor = vk::ClearColorValue(std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f})) {    
+    vk::ClearValue clearColor = vk::ClearColorValue(std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f}),
+    vk::SubpassContents contents = vk::SubpassContents::eInline) {    
     this->render_pass = render_pass;
+    subpass = 0;
     vk::RenderPassBeginInfo render_pass_info = {};
     render_pass_info.renderPass            = render_pass;
     render_pass_info.framebuffer           = getCurrentFrameBuffer();
@@ -2428,86 +6301,149 @@ struct Present {
     render_pass_info.renderArea.extent     = swapchain->extent;
     render_pass_info.clearValueCount       = 1;
     render_pass_info.pClearValues          = &clearColor;
-    getCurrentCommandBuffer().beginRenderPass(render_pass_info, vk::SubpassContents::eInline);
+    getCurrentCommandBuffer().beginRenderPass(render_pass_info, contents, dispatch());
+  }
+
+  void nextSubpass(vk::SubpassContents contents = vk::SubpassContents::eInline) {
+    getCurrentCommandBuffer().nextSubpass(contents, dispatch());
+    subpass++;
+  }
+
+  // Record the current subpass with `count` secondary command buffers.
+  // `func(cb, index)` fills them concurrently on the worker threads, each
+  // thread allocating from its own pool of the frame slot, and they are
+  // executed in index order. The subpass must have been started with
+  // vk::SubpassContents::eSecondaryCommandBuffers. Dynamic state is not
+  // inherited, set viewport and scissor in every command buffer.
+  void recordParallel(uint32_t count,
+                      const std::function<void(vk::CommandBuffer cb, uint32_t index)> &func) {
+    if (count == 0)
+      return;
+    if (!workers)
+      workers = std::make_shared<helper::ThreadPool>(recording_threads);
+
+    vk::CommandBufferInheritanceInfo inheritance;
+    inheritance.renderPass  = render_pass;
+    inheritance.subpass     = subpass;
+    inheritance.framebuffer = getCurrentFrameBuffer();
+
+    std::vector<vk::CommandBuffer> secondaries(count);
+    workers->parallel_for(count, [&](size_t i) {
+      vk::CommandBuffer cb = command_pools->allocate(vk::CommandBufferLevel::eSecondary);
+      vk::CommandBufferBeginInfo begin_info{
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
+        vk::CommandBufferUsageFlagBits::eRenderPassContinue, &inheritance};
+      cb.begin(begin_info, dispatch());
+      func(cb, static_cast<uint32_t>(i));
+      cb.end(dispatch());
+      secondaries[i] = cb;
+    });
+    getCurrentCommandBuffer().executeCommands(count, secondaries.data(), dispatch());
+  }
+
+  // Execute the command buffer cached under `id` in the current subpass,
+  // recording it with `func` the first time and whenever `dependencies`,
+  // the render pass, the subpass or the swapchain extent changed. The
+  // subpass must have been started with
+  // vk::SubpassContents::eSecondaryCommandBuffers.
+  void executeCached(uint64_t id, CommandDependencies dependencies,
+                     const std::function<void(vk::CommandBuffer cb)> &func) {
+    dependencies.addExtent(swapchain->extent);
+    // No framebuffer, one recording serves every swapchain image.
+    vk::CommandBufferInheritanceInfo inheritance;
+    inheritance.renderPass = render_pass;
+    inheritance.subpass    = subpass;
+    vk::CommandBuffer cb = command_cache->get(id, dependencies, inheritance, func);
+    getCurrentCommandBuffer().executeCommands(1, &cb, dispatch());
+  }
+
+  // One secondary command buffer per recording thread.
+  void recordParallel(const std::function<void(vk::CommandBuffer cb, uint32_t index)> &func) {
+    if (!workers)
+      workers = std::make_shared<helper::ThreadPool>(recording_threads);
+    recordParallel(workers->size(), func);
   }
 
   void endRenderPass() {
-    getCurrentCommandBuffer().endRenderPass();
+    getCurrentCommandBuffer().endRenderPass(dispatch());
+  }
+
+  // Device level table when the device was built with use_device_dispatch,
+  // pass it to the commands recorded into getCurrentCommandBuffer().
+  const vk::DispatchLoaderDynamic& dispatch() const {
+    return device->dispatch();
   }
 
-  vk::Fence& getInFlightFence() {
-    return in_flight_fences[swapchain->current_frame];
+  // Graphics timeline value of the last frame submitted from this slot.
+  SubmitToken& getFrameValue() {
+    return frame_values[frame_index];
   }
-  vk::Fence& getImageInFlight(uint32_t idx) {
-    return image_in_flight[idx];
+  SubmitToken& getImageValue(uint32_t idx) {
+    return image_values[idx];
   }
   vk::Semaphore& getAvailableSemaphore() {
-    return available_semaphores[swapchain->current_frame];
+    return available_semaphores[frame_index];
   }
 
   vk::Semaphore& getFinishedSemaphore() {
-    return finished_semaphore[swapchain->current_frame];
+    return finished_semaphore[image_index];
   }
 
+  // The old swapchain and its views may still be used by frames in flight
+  // and by pending presents, they are handed to the device's DeletionQueue
+  // instead of destroyed. Presents carry no fence, an empty submission on
+  // the present queue marks when the earlier ones have been processed.
   void create_swapchain() {
     vkb::SwapchainBuilder swapchain_builder{*device};
     auto swap_ret = swapchain_builder.set_old_swapchain(*swapchain).build();
-    swapchain->destroy();
+    if (pending_presents) {
+      present_timeline->submit(vk::SubmitInfo{});
+      pending_presents = 0;
+    }
+    auto &deletion = *device->deletion;
+    for (auto view : swapchain->swapchain_imageviews)
+      deletion.retire(view);
+    deletion.retire(swapchain->instance);
     *swapchain = swap_ret;
   }
 
   void recreate_swapchain() {
-    (*device)->waitIdle();
-    (*device)->destroyCommandPool(command_pool, device->allocation_callbacks);
-    for (auto framebuffer : framebuffers) {
-      (*device)->destroyFramebuffer(framebuffer, device->allocation_callbacks);
-    }
+    auto &deletion = *device->deletion;
+    for (auto framebuffer : framebuffers)
+      deletion.retire(framebuffer);
+    device->retireSemaphores(finished_semaphore);
 
-    swapchain->destroy_imageviews();
     create_swapchain();
     framebuffers = swapchain->createFramebuffers(this->render_pass);
-    command_pool = device->createCommandPool();
-    command_buffers = device->createCommandBuffers(
-                         command_pool, swapchain->image_count);
+    image_values.assign(swapchain->image_count, 0);
+    finished_semaphore = device->acquireSemaphores(swapchain->image_count);
   }
 
+  // Submit the current frame slot and present its image. Only the timeline
+  // value of the slot that is reused next is waited on, in begin().
+  // The frame and everything added with submit() go out in one
+  // vkQueueSubmit.
   void drawFrame() {
-    auto dev = *device;
-    dev->waitForFences(1, &getInFlightFence(), true, UINT64_MAX);
-
-    uint32_t image_index = 0;
-    vk::Result result = dev->acquireNextImageKHR(*swapchain, UINT64_MAX,
-                        getAvailableSemaphore(), vk::Fence(), &image_index);
-    if (result == vk::Result::eErrorOutOfDateKHR) {
-      recreate_swapchain();
-      return;
-    } else if (result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR) {
-      throw std::runtime_error("failed to acquire swapchain image.");
-    }
-
-    if (getImageInFlight(image_index)) {
-        dev->waitForFences(1, &getImageInFlight(image_index), true, UINT64_MAX);
-    }
-    getImageInFlight(image_index) = getInFlightFence();
-
-    vk::Semaphore          wait_semaphores[] = { getAvailableSemaphore() };
-    vk::PipelineStageFlags wait_stages[]     = {vk::PipelineStageFlagBits::eColorAttachmentOutput};
-
-    vk::SubmitInfo submitInfo;
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores    = wait_semaphores;
-    submitInfo.pWaitDstStageMask  = wait_stages;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers    = &getCurrentCommandBuffer();
-
+    // Command buffers added with submit() may read the same data as the
+    // frame's own, the extra waits go on the first batch.
+    std::vector<TimelineWait> extra_waits;
+    for (size_t i = 0; i < extra_wait_semaphores.size(); ++i)
+      extra_waits.push_back({ extra_wait_semaphores[i], extra_wait_values[i], extra_wait_stages[i] });
+    extra_wait_semaphores.clear();
+    extra_wait_stages.clear();
+    extra_wait_values.clear();
+    submits->prependWaits(extra_waits);
+
+    std::vector<TimelineWait> waits = {
+      { getAvailableSemaphore(), 0, vk::PipelineStageFlagBits::eColorAttachmentOutput }
+    };
     vk::Semaphore signal_semaphores[] = { getFinishedSemaphore() };
-    submitInfo.signalSemaphoreCount   = 1;
-    submitInfo.pSignalSemaphores      = signal_semaphores;
-
-    dev->resetFences(1, &getInFlightFence());
-    graphics_queue.submit(1, &submitInfo, getInFlightFence());
-
-    dev->waitIdle();
+    submits->add(getCurrentCommandBuffer(), waits, { { signal_semaphores[0], 0 } });
+    SubmitToken value = submits->flush();
+    command_pools->endFrame(value);
+    command_cache->endFrame(value);
+    getFrameValue() = value;
+    getImageValue(image_index) = value;
 
     vk::PresentInfoKHR present_info = {};
     present_info.waitSemaphoreCount = 1;
@@ -2518,14 +6454,47 @@ struct Present {
     present_info.pSwapchains      = swapChains;
     present_info.pImageIndices    = &image_index;
 
-    result = present_queue.presentKHR(&present_info);
+    vk::Result result = present_timeline->present(present_info);
+    pending_presents++;
     if (result == vk::Result::eErrorOutOfDateKHR 
          || result == vk::Result::eSuboptimalKHR) {
       recreate_swapchain();
     } else if (result != vk::Result::eSuccess) {
       throw std::runtime_error("failed to present swapchain image");
     }
-    swapchain->current_frame = (swapchain->current_frame + 1) % swapchain->image_count;
+    // Everything retired while recording this frame waits for its submission.
+    device->deletion->endFrame();
+    frame_index = (frame_index + 1) % frames_in_flight;
+  }
+
+  // Wait for the frames in flight, destroy the command pools and give the
+  // semaphores back to the device.
+  void destroy() {
+    if (command_pools)
+      command_pools->destroy();
+    if (command_cache)
+      command_cache->destroy();
+    device->retireSemaphores(available_semaphores);
+    device->retireSemaphores(finished_semaphore);
+    available_semaphores.clear();
+    finished_semaphore.clear();
+  }
+
+private:
+  void acquire() {
+    vk::Device dev = device->instance;
+    for (;;) {
+      vk::Result result = dev.acquireNextImageKHR(*swapchain, UINT64_MAX,
+                          getAvailableSemaphore(), vk::Fence(), &image_index, dispatch());
+      if (result == vk::Result::eErrorOutOfDateKHR) {
+        recreate_swapchain();
+        continue;
+      } else if (result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR) {
+        throw std::runtime_error("failed to acquire swapchain image.");
+      }
+      swapchain->current_frame = image_index;
+      return;
+    }
   }
 };
 
@@ -2536,26 +6505,59 @@ public:
     : device(device), swapchain(swapchain) {}
   virtual ~PresentBuilder() {}
 
+  // Number of frames the CPU may record ahead of the GPU. Independent of the
+  // swapchain image count. Defaults to 2.
+  PresentBuilder& set_frames_in_flight(uint32_t count) {
+    frames_in_flight = std::max(count, 1u);
+    return *this;
+  }
+
+  // Threads used by Present::recordParallel, including the recording
+  // thread. 0 picks one per core.
+  PresentBuilder& set_recording_threads(uint32_t count) {
+    recording_threads = count;
+    return *this;
+  }
+
+  // Share an existing pool instead of creating one.
+  PresentBuilder& set_thread_pool(std::shared_ptr<helper::ThreadPool> pool) {
+    thread_pool = std::move(pool);
+    return *this;
+  }
+
   Present build(vk::RenderPass render_pass) {
     Present cb{device, swapchain};
-    cb.command_pool = device.createCommandPool();
-    cb.command_buffers = device.createCommandBuffers(
-                         cb.command_pool, swapchain.image_count);
-    cb.framebuffers = swapchain.createFramebuffers(render_pass);
+    cb.frames_in_flight = frames_in_flight;
+    cb.render_pass = render_pass;
+    cb.graphics_timeline = device.timeline(QueueType::graphics);
+    cb.command_pools = std::make_shared<CommandPoolManager>(
+        device.instance, cb.graphics_timeline, frames_in_flight,
+        device.allocation_callbacks);
+    cb.command_buffers.assign(frames_in_flight, vk::CommandBuffer());
+    cb.submits = std::make_shared<SubmitBatcher>(cb.graphics_timeline);
+    cb.command_cache = std::make_shared<CommandCache>(
+        device.instance, cb.graphics_timeline, device.allocation_callbacks);
+    cb.workers = thread_pool;
+    cb.recording_threads = recording_threads;
+    cb.frame_values.assign(frames_in_flight, 0);
+    cb.available_semaphores = device.acquireSemaphores(frames_in_flight);
 
-    cb.in_flight_fences = device.createFences(swapchain.image_count);
-    cb.image_in_flight = device.createFences(swapchain.image_count);
-    cb.available_semaphores = device.createSemaphores(swapchain.image_count);
-    cb.finished_semaphore = device.createSemaphores(swapchain.image_count);
+    cb.framebuffers = swapchain.createFramebuffers(render_pass);
+    cb.image_values.assign(swapchain.image_count, 0);
+    cb.finished_semaphore = device.acquireSemaphores(swapchain.image_count);
 
     cb.graphics_queue = device.getQueue(QueueType::graphics);
     cb.present_queue = device.getQueue(QueueType::present);
+    cb.present_timeline = device.timeline(QueueType::present);
     return cb;
   }
 
 protected:
   Device& device;
   Swapchain& swapchain;
+  uint32_t frames_in_flight = 2;
+  uint32_t recording_threads = 0;
+  std::shared_ptr<helper::ThreadPool> thread_pool;
 };
 
 
@@ -2565,7 +6567,9 @@ protected:
 #pragma region Buffer
 
 
-inline static /// Execute commands immediately and wait for the device to finish.
+inline static /// Execute commands immediately and wait for them to finish.
+/// Only this submission is waited on, not the whole device. Prefer
+/// ImmediateContext::submit, which does not block.
 void executeImmediately(vk::Device device, vk::CommandPool commandPool, vk::Queue queue, const std::function<void (vk::CommandBuffer cb)> &func) {
   vk::CommandBufferAllocateInfo cbai{ commandPool, vk::CommandBufferLevel::ePrimary, 1 };
 
@@ -2577,12 +6581,42 @@ void executeImmediately(vk::Device device, vk::CommandPool commandPool, vk::Queu
   vk::SubmitInfo submit;
   submit.commandBufferCount = (uint32_t)cbs.size();
   submit.pCommandBuffers = cbs.data();
-  queue.submit(submit, vk::Fence{});
-  device.waitIdle();
+  vk::Fence fence = device.createFence(vk::FenceCreateInfo{});
+  queue.submit(submit, fence);
+  device.waitForFences(1, &fence, true, UINT64_MAX);
+  device.destroyFence(fence);
 
   device.freeCommandBuffers(commandPool, cbs);
 }
 
+inline static /// Same as above, with the fence taken from the device's FencePool.
+void executeImmediately(const Device& device, vk::CommandPool commandPool, vk::Queue queue, const std::function<void (vk::CommandBuffer cb)> &func) {
+  vk::Device dev = device.instance;
+  auto &d = device.dispatch();
+  vk::CommandBufferAllocateInfo cbai{ commandPool, vk::CommandBufferLevel::ePrimary, 1 };
+
+  vk::CommandBuffer cb;
+  if (dev.allocateCommandBuffers(&cbai, &cb, d) != vk::Result::eSuccess)
+    throw std::runtime_error("failed_allocate_command_buffers");
+  cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit}, d);
+  func(cb);
+  cb.end(d);
+
+  vk::SubmitInfo submit;
+  submit.commandBufferCount = 1;
+  submit.pCommandBuffers = &cb;
+  vk::Fence fence = device.fences->acquire();
+  vk::Result result = queue.submit(1, &submit, fence, d);
+  if (result == vk::Result::eSuccess)
+    dev.waitForFences(1, &fence, true, UINT64_MAX, d);
+  dev.freeCommandBuffers(commandPool, 1, &cb, d);
+  if (result != vk::Result::eSuccess) {
+    dev.destroyFence(fence, device.allocation_callbacks, d);
+    throw std::runtime_error("failed_queue_submit");
+  }
+  device.fences->release(fence);
+}
+
 
 /// Scale a value by mip level, but do not reduce to zero.
 inline uint32_t mipScale(uint32_t value, uint32_t mipLevel) {
@@ -2799,18 +6833,22 @@ inline BlockParams getBlockParams(vk::Format format) {
 /// Buffers require memory objects which represent GPU and CPU resources.
 struct GenericBuffer {
   vk::Buffer buffer;
-  vk::DeviceMemory memory;
+  MemoryAllocation allocation;
   vk::DeviceSize size;
   vkb::Device* device;
+  /// Created with vk::SharingMode::eConcurrent, see allocate().
+  bool concurrent = false;
 
   GenericBuffer() {}
 
-  GenericBuffer(vkb::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal) 
+  GenericBuffer(vkb::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal, bool shared = false) 
   {
-    allocate(device, usage, size, memflags);
+    allocate(device, usage, size, memflags, shared);
   }
 
-  void allocate(vkb::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal)
+  /// With `shared` the buffer is usable from the graphics, compute (Device::compute) and transfer
+  /// queues without ownership transfers, so it can also be uploaded to in parts.
+  void allocate(vkb::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal, bool shared = false)
   {
     this->size = size;
     this->device = &device;
@@ -2819,22 +6857,45 @@ struct GenericBuffer {
     ci.size = size;
     ci.usage = usage;
     ci.sharingMode = vk::SharingMode::eExclusive;
+    std::vector<uint32_t> families = { device.get_queue_index(QueueType::graphics) };
+    if (shared) {
+      if (device.compute && device.compute->isAsync())
+        families.push_back(device.compute->get_queue_family());
+      if (device.transfer) {
+        uint32_t transfer = device.transfer->get_timeline()->get_queue_family();
+        if (std::find(families.begin(), families.end(), transfer) == families.end())
+          families.push_back(transfer);
+      }
+    }
+    concurrent = families.size() > 1;
+    if (concurrent) {
+      ci.sharingMode = vk::SharingMode::eConcurrent;
+      ci.queueFamilyIndexCount = static_cast<uint32_t>(families.size());
+      ci.pQueueFamilyIndices = families.data();
+    }
     buffer = device->createBuffer(ci, device.allocation_callbacks);
 
     // Find out how much memory and which heap to allocate from.
     auto memreq = device->getBufferMemoryRequirements(buffer);
 
-    // Create a memory object to bind to the buffer.
-    vk::MemoryAllocateInfo allocInfo{};
-    allocInfo.allocationSize = memreq.size;
-    allocInfo.memoryTypeIndex = device.physical_device.findMemoryTypeIndex(memreq.memoryTypeBits, memflags);
-    memory = device->allocateMemory(allocInfo, device.allocation_callbacks);
+    // Take a range out of one of the device's memory blocks.
+    allocation = device.allocator->allocate(memreq, memflags, true);
 
-    device->bindBufferMemory(buffer, memory, 0);
+    device->bindBufferMemory(buffer, allocation.memory, allocation.offset);
   }
 
+  /// Destroy the buffer and free its memory once the GPU is done with it.
+  /// Goes through the device's DeletionQueue, so this never stalls.
   void release() {
-    (*device)->destroyBuffer(buffer, (*device).allocation_callbacks);
+    auto &deletion = *device->deletion;
+    deletion.retire(buffer);
+    if (allocation) {
+      auto allocator = device->allocator;
+      auto a = allocation;
+      deletion.retire([allocator, a]() { allocator->free(a); });
+    }
+    buffer = vk::Buffer();
+    allocation = MemoryAllocation{};
   }
 
   inline static /// Utility function for finding memory types for uniforms and images.
@@ -2847,18 +6908,44 @@ struct GenericBuffer {
   }
 
   /// For a purely device local buffer, copy memory to the buffer object immediately.
-  /// Note that this will stall the pipeline!
+  /// Note that this will stall until the copy has finished!
   void upload(vk::CommandPool commandPool, vk::Queue queue, const void *value, vk::DeviceSize size) const {
     if (size == 0) return;
-    using buf = vk::BufferUsageFlagBits;
-    using pfb = vk::MemoryPropertyFlagBits;
-    auto tmp = GenericBuffer(*device, buf::eTransferSrc, size, pfb::eHostVisible);
-    tmp.updateLocal(value, size);
-
-    executeImmediately(device->instance, commandPool, queue, [&](vk::CommandBuffer cb) {
-      vk::BufferCopy bc{0, 0, size};
-      cb.copyBuffer(tmp.buffer, buffer, bc);
-    });
+    // Stage through the device's ring instead of a fresh host visible buffer.
+    auto &ring = *device->staging;
+    auto region = ring.allocate(size);
+    memcpy(region.data, value, (size_t)size);
+
+    try {
+      executeImmediately(*device, commandPool, queue, [&](vk::CommandBuffer cb) {
+        vk::BufferCopy bc{region.offset, 0, size};
+        cb.copyBuffer(region.buffer, buffer, bc, device->dispatch());
+      });
+    } catch (...) {
+      ring.retire(region);
+      throw;
+    }
+    ring.retire(region);
+  }
+
+  /// Copy memory to a device local buffer without blocking.
+  /// The copy runs on the device's TransferEngine. The buffer is acquired by the graphics queue with the next
+  /// TransferEngine::recordAcquire, which Present::begin does every frame, or TransferEngine::acquire.
+  /// Copying less than the whole buffer needs a `shared` buffer when the transfer queue is separate, see
+  /// TransferEngine::upload. The copy waits for the graphics work submitted so far, so buffers still in use
+  /// by frames in flight can be updated.
+  SubmitToken upload(const void *value, vk::DeviceSize size) const {
+    return device->transfer->upload(buffer, this->size, 0, value, size, concurrent);
+  }
+
+  template<typename T>
+  SubmitToken upload(const std::vector<T> &value) const {
+    return upload(value.data(), value.size() * sizeof(T));
+  }
+
+  template<typename T>
+  SubmitToken upload(const T &value) const {
+    return upload(&value, sizeof(value));
   }
 
   template<typename T>
@@ -2873,15 +6960,14 @@ struct GenericBuffer {
 
   void barrier(vk::CommandBuffer cb, vk::PipelineStageFlags srcStageMask, vk::PipelineStageFlags dstStageMask, vk::DependencyFlags dependencyFlags, vk::AccessFlags srcAccessMask, vk::AccessFlags dstAccessMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex) const {
     vk::BufferMemoryBarrier bmb{srcAccessMask, dstAccessMask, srcQueueFamilyIndex, dstQueueFamilyIndex, buffer, 0, size};
-    cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, nullptr, bmb, nullptr);
+    cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, nullptr, bmb, nullptr, device->dispatch());
   }
 
   /// For a host visible buffer, copy memory to the buffer object.
+  /// Writes straight through the persistent mapping.
   void updateLocal(const void *value, vk::DeviceSize size) const {
-    void *ptr = (*device)->mapMemory(memory, 0, size, vk::MemoryMapFlags{});
-    memcpy(ptr, value, (size_t)size);
+    memcpy(map(), value, (size_t)size);
     // flush();
-    (*device)->unmapMemory(memory);
   }
 
   template<class Type, class Allocator>
@@ -2894,16 +6980,18 @@ struct GenericBuffer {
     updateLocal( (void*)&value, vk::DeviceSize(sizeof(Type)));
   }
 
-  void *map() const { return (*device)->mapMemory(memory, 0, size, vk::MemoryMapFlags{}); };
-  void unmap() const { return (*device)->unmapMemory(memory); };
+  /// The persistently mapped contents of a host visible buffer.
+  void *map() const { return device->allocator->map(allocation); };
+  /// Kept for existing callers, the buffer stays mapped until it is released.
+  void unmap() const {};
 
   void flush() const {
-    vk::MappedMemoryRange mr{memory, 0, VK_WHOLE_SIZE};
+    vk::MappedMemoryRange mr{allocation.memory, allocation.offset, allocation.size};
     return (*device)->flushMappedMemoryRanges(mr);
   }
 
   void invalidate() const {
-    vk::MappedMemoryRange mr{memory, 0, VK_WHOLE_SIZE};
+    vk::MappedMemoryRange mr{allocation.memory, allocation.offset, allocation.size};
     return (*device)->invalidateMappedMemoryRanges(mr);
   }
 
@@ -2989,6 +7077,391 @@ struct UniformBuffer : public GenericBuffer {
   }
 };
 
+/// This class is a specialisation of GenericBuffer for storage buffers read and written by shaders.
+/// Shared between the graphics and the compute queue.
+struct StorageBuffer : public GenericBuffer {
+  StorageBuffer() {}
+  StorageBuffer(vkb::Device& device, vk::DeviceSize size) {
+    allocate(device, size);
+  }
+
+  void allocate(vkb::Device& device, vk::DeviceSize size) {
+    GenericBuffer::allocate(device, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+                    size, vk::MemoryPropertyFlagBits::eDeviceLocal, true);
+  }
+};
+
+/// One object of a GPU-driven scene, as stored in the storage buffer the indirect passes read (std430).
+/// `bounds` is the world space bounding sphere (center, radius) and `extents` the half size of the
+/// bounding box around the same center, used by the culling passes.
+struct IndirectObject {
+  float bounds[4];
+  float extents[4];
+  uint32_t indexCount;
+  uint32_t firstIndex;
+  int32_t vertexOffset;
+  uint32_t firstInstance;
+};
+
+/// Indirect draw arguments on the GPU, written by compute passes (see IndirectFillPass) or uploaded.
+/// The buffer starts with a 16 byte header holding the draw count for the *IndirectCount draws, the
+/// commands follow at `commandsOffset`. Shared between the graphics and the compute queue.
+///
+/// A buffer written every frame should exist once per frame in flight, or the writes of one frame
+/// race with the draws of the previous one.
+struct IndirectDrawBuffer : public GenericBuffer {
+  static constexpr vk::DeviceSize countOffset = 0;
+  static constexpr vk::DeviceSize commandsOffset = 16;
+
+  uint32_t maxDraws = 0;
+  bool indexed = true;
+
+  IndirectDrawBuffer() {}
+  IndirectDrawBuffer(vkb::Device& device, uint32_t maxDraws, bool indexed = true) {
+    allocate(device, maxDraws, indexed);
+  }
+
+  void allocate(vkb::Device& device, uint32_t maxDraws, bool indexed = true) {
+    this->maxDraws = maxDraws;
+    this->indexed = indexed;
+    GenericBuffer::allocate(device, vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer |
+                    vk::BufferUsageFlagBits::eTransferDst,
+                    commandsOffset + vk::DeviceSize(maxDraws) * stride(), vk::MemoryPropertyFlagBits::eDeviceLocal, true);
+  }
+
+  uint32_t stride() const {
+    return indexed ? sizeof(vk::DrawIndexedIndirectCommand) : sizeof(vk::DrawIndirectCommand);
+  }
+
+  using GenericBuffer::upload;
+
+  /// Upload the draw count and the commands without blocking, see GenericBuffer::upload.
+  template<class Command>
+  SubmitToken upload(const std::vector<Command> &commands) const {
+    if (sizeof(Command) != stride() || commands.size() > maxDraws)
+      throw std::runtime_error("invalid_indirect_commands");
+    std::vector<uint8_t> data(commandsOffset + commands.size() * sizeof(Command), 0);
+    uint32_t count = static_cast<uint32_t>(commands.size());
+    memcpy(data.data() + countOffset, &count, sizeof(count));
+    if (!commands.empty())
+      memcpy(data.data() + commandsOffset, commands.data(), commands.size() * sizeof(Command));
+    return GenericBuffer::upload(data.data(), data.size());
+  }
+
+  /// Draw `drawCount` commands, the count known on the CPU.
+  void draw(CommandRecorder &recorder, uint32_t drawCount) const {
+    if (indexed)
+      recorder.drawIndexedIndirect(buffer, commandsOffset, drawCount, stride());
+    else
+      recorder.drawIndirect(buffer, commandsOffset, drawCount, stride());
+  }
+
+  /// Draw as many commands as the count in the header says, at most maxDraws. The CPU cost does not
+  /// depend on the number of draws. Needs Device::draw_indirect_count.
+  void drawCount(CommandRecorder &recorder) const {
+    if (!device->draw_indirect_count)
+      throw std::runtime_error("draw_indirect_count_not_enabled");
+    if (indexed)
+      recorder.drawIndexedIndirectCount(buffer, commandsOffset, buffer, countOffset, maxDraws, stride());
+    else
+      recorder.drawIndirectCount(buffer, commandsOffset, buffer, countOffset, maxDraws, stride());
+  }
+};
+
+/// Base of the compute passes that read a StorageBuffer of IndirectObjects (set 0, binding 0) and
+/// write an IndirectDrawBuffer (set 0, binding 1), with the parameters in push constants.
+///
+/// Descriptor sets are cached per (objects, commands) buffer pair, call clearSets() before such a
+/// buffer is released.
+class IndirectComputePass {
+public:
+  static constexpr uint32_t groupSize = 64;
+
+  /// Drop the cached descriptor sets once the GPU is done with them.
+  void clearSets() {
+    for (auto pool : pools)
+      device->deletion->retire(pool);
+    pools.clear();
+    sets.clear();
+    setsLeft = 0;
+  }
+
+  /// Destroy the pipeline and the descriptor pools once the GPU is done with them.
+  void release() {
+    if (!device)
+      return;
+    clearSets();
+    device->deletion->retire(pipeline);
+    pipeline = vk::Pipeline();
+  }
+
+  vk::Pipeline getPipeline() const { return pipeline; }
+  vk::PipelineLayout getLayout() const { return pipelineLayout; }
+
+protected:
+  /// `extraLayouts` are bound as sets 1, 2...
+  void createPass(vkb::Device& device, const std::string& shaderPath, uint32_t pushConstantSize,
+                  const std::vector<vk::DescriptorSetLayout>& extraLayouts = {}) {
+    this->device = &device;
+    setLayout = device.layouts->getDescriptorSetLayout({
+      {0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute},
+      {1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute},
+    });
+    ComputePipelineBuilder builder{device};
+    builder.setShader(shaderPath)
+           .addDescriptorSetLayout(setLayout)
+           .addPushConstantRange(0, pushConstantSize);
+    for (auto layout : extraLayouts)
+      builder.addDescriptorSetLayout(layout);
+    pipeline = builder.build();
+    pipelineLayout = builder.getLayout();
+  }
+
+  /// Bind the pipeline and the buffers, push `constants` and dispatch one thread per object.
+  /// With `graphicsQueue` the barriers against the draws of earlier and later commands on the same
+  /// queue are recorded too.
+  void dispatchObjects(vk::CommandBuffer cb, const GenericBuffer &objects, const IndirectDrawBuffer &commands,
+                       uint32_t objectCount, const void *constants, uint32_t constantSize, bool graphicsQueue,
+                       const std::vector<vk::DescriptorSet> &extraSets = {}, bool resetCount = false) {
+    if (!commands.indexed || objectCount > commands.maxDraws)
+      throw std::runtime_error("invalid_indirect_pass");
+    auto &d = device->dispatch();
+    if (graphicsQueue) {
+      vk::BufferMemoryBarrier before{vk::AccessFlagBits::eIndirectCommandRead, vk::AccessFlagBits::eShaderWrite |
+                                     vk::AccessFlagBits::eTransferWrite,
+                                     VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, commands.buffer, 0, VK_WHOLE_SIZE};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect,
+                         vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+                         vk::DependencyFlags{}, 0, nullptr, 1, &before, 0, nullptr, d);
+    }
+    if (resetCount) {
+      // The shader counts the survivors with atomics, start from 0.
+      cb.fillBuffer(commands.buffer, IndirectDrawBuffer::countOffset, sizeof(uint32_t), 0, d);
+      vk::BufferMemoryBarrier cleared{vk::AccessFlagBits::eTransferWrite,
+                                      vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, commands.buffer,
+                                      IndirectDrawBuffer::countOffset, sizeof(uint32_t)};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+                         vk::DependencyFlags{}, 0, nullptr, 1, &cleared, 0, nullptr, d);
+    }
+
+    std::vector<vk::DescriptorSet> bound = {getSet(objects.buffer, commands.buffer)};
+    bound.insert(bound.end(), extraSets.begin(), extraSets.end());
+    cb.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline, d);
+    cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipelineLayout, 0,
+                          static_cast<uint32_t>(bound.size()), bound.data(), 0, nullptr, d);
+    cb.pushConstants(pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, constantSize, constants, d);
+    cb.dispatch(std::max((objectCount + groupSize - 1) / groupSize, 1u), 1, 1, d);
+
+    if (graphicsQueue) {
+      vk::BufferMemoryBarrier after{vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead,
+                                    VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, commands.buffer, 0, VK_WHOLE_SIZE};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect,
+                         vk::DependencyFlags{}, 0, nullptr, 1, &after, 0, nullptr, d);
+    }
+  }
+
+  vkb::Device* device = nullptr;
+
+private:
+  vk::DescriptorSet getSet(vk::Buffer objects, vk::Buffer commands) {
+    auto key = std::make_pair((uint64_t)static_cast<VkBuffer>(objects), (uint64_t)static_cast<VkBuffer>(commands));
+    auto it = sets.find(key);
+    if (it != sets.end())
+      return it->second;
+
+    if (setsLeft == 0) {
+      vk::DescriptorPoolSize size{vk::DescriptorType::eStorageBuffer, 2 * setsPerPool};
+      vk::DescriptorPoolCreateInfo info{vk::DescriptorPoolCreateFlags{}, setsPerPool, 1, &size};
+      pools.push_back((*device)->createDescriptorPool(info, device->allocation_callbacks));
+      setsLeft = setsPerPool;
+    }
+    vk::DescriptorSetAllocateInfo info{pools.back(), 1, &setLayout};
+    vk::DescriptorSet set = (*device)->allocateDescriptorSets(info)[0];
+    setsLeft--;
+
+    vk::DescriptorBufferInfo infos[2] = {
+      {objects, 0, VK_WHOLE_SIZE},
+      {commands, 0, VK_WHOLE_SIZE},
+    };
+    vk::WriteDescriptorSet writes[2];
+    for (uint32_t i = 0; i < 2; ++i) {
+      writes[i].dstSet = set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = vk::DescriptorType::eStorageBuffer;
+      writes[i].pBufferInfo = &infos[i];
+    }
+    (*device)->updateDescriptorSets(2, writes, 0, nullptr);
+    sets.emplace(key, set);
+    return set;
+  }
+
+  static constexpr uint32_t setsPerPool = 16;
+
+  vk::DescriptorSetLayout setLayout;
+  vk::PipelineLayout pipelineLayout;
+  vk::Pipeline pipeline;
+  std::vector<vk::DescriptorPool> pools;
+  uint32_t setsLeft = 0;
+  std::map<std::pair<uint64_t, uint64_t>, vk::DescriptorSet> sets;
+};
+
+/// Writes one indexed draw per IndirectObject into an IndirectDrawBuffer with a compute dispatch, so
+/// the CPU only records a dispatch and a drawCount however many objects there are.
+/// The shader is shader/indirect_fill.comp, compiled to indirect_fill.spv by the build.
+class IndirectFillPass : public IndirectComputePass {
+public:
+  IndirectFillPass() {}
+  IndirectFillPass(vkb::Device& device, const std::string& shaderPath = "indirect_fill.spv") {
+    create(device, shaderPath);
+  }
+
+  void create(vkb::Device& device, const std::string& shaderPath = "indirect_fill.spv") {
+    createPass(device, shaderPath, sizeof(uint32_t));
+  }
+
+  /// Record the fill of `commands` from the first `objectCount` objects. With `graphicsQueue` the
+  /// barriers against the draws of earlier and later commands on the same queue are recorded too.
+  /// On the async compute queue synchronize through ComputeContext instead.
+  void record(vk::CommandBuffer cb, const GenericBuffer &objects, const IndirectDrawBuffer &commands,
+              uint32_t objectCount, bool graphicsQueue = true) {
+    dispatchObjects(cb, objects, commands, objectCount, &objectCount, sizeof(objectCount), graphicsQueue);
+  }
+};
+
+/// The six planes of a view frustum, normals pointing inside: xyz normal, w distance.
+/// Order: left, right, bottom, top, near, far.
+struct Frustum {
+  float planes[6][4];
+
+  /// Extract the planes from a column major view-projection matrix (glm: &matrix[0][0]) with Vulkan's
+  /// [0, 1] clip space depth.
+  static Frustum fromMatrix(const float *m) {
+    auto row = [m](int r, float (&out)[4]) {
+      for (int c = 0; c < 4; ++c)
+        out[c] = m[c * 4 + r];
+    };
+    float r0[4], r1[4], r2[4], r3[4];
+    row(0, r0); row(1, r1); row(2, r2); row(3, r3);
+
+    Frustum f;
+    for (int i = 0; i < 4; ++i) {
+      f.planes[0][i] = r3[i] + r0[i];
+      f.planes[1][i] = r3[i] - r0[i];
+      f.planes[2][i] = r3[i] + r1[i];
+      f.planes[3][i] = r3[i] - r1[i];
+      f.planes[4][i] = r2[i];
+      f.planes[5][i] = r3[i] - r2[i];
+    }
+    for (auto &plane : f.planes) {
+      float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+      if (length > 0)
+        for (auto &value : plane)
+          value /= length;
+    }
+    return f;
+  }
+
+  bool containsSphere(const float center[3], float radius) const {
+    for (auto &p : planes)
+      if (p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3] < -radius)
+        return false;
+    return true;
+  }
+
+  bool containsAabb(const float center[3], const float extents[3]) const {
+    for (auto &p : planes) {
+      float distance = p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3];
+      float reach = std::abs(p[0]) * extents[0] + std::abs(p[1]) * extents[1] + std::abs(p[2]) * extents[2];
+      if (distance + reach < 0)
+        return false;
+    }
+    return true;
+  }
+};
+
+/// Tests every IndirectObject against a frustum in a compute shader and compacts the visible ones into
+/// an IndirectDrawBuffer, counting them with an atomic in its header. Draw the result with
+/// IndirectDrawBuffer::drawCount. The shader is shader/frustum_cull.comp, compiled to frustum_cull.spv
+/// by the build. Nonzero firstInstance values need the drawIndirectFirstInstance feature.
+///
+/// The survivors are written in no particular order. cullReference gives the expected result on the
+/// CPU, compare it with sameDraws, e.g. on a software implementation after reading the buffer back
+/// and decoding it with readCommands.
+class FrustumCullPass : public IndirectComputePass {
+public:
+  enum class Bounds : uint32_t { sphere = 0, aabb = 1 };
+
+  FrustumCullPass() {}
+  FrustumCullPass(vkb::Device& device, const std::string& shaderPath = "frustum_cull.spv") {
+    create(device, shaderPath);
+  }
+
+  void create(vkb::Device& device, const std::string& shaderPath = "frustum_cull.spv") {
+    createPass(device, shaderPath, sizeof(Params));
+  }
+
+  /// Record the culling of the first `objectCount` objects into `commands`. See
+  /// IndirectFillPass::record for `graphicsQueue`.
+  void record(vk::CommandBuffer cb, const GenericBuffer &objects, const IndirectDrawBuffer &commands,
+              uint32_t objectCount, const Frustum &frustum, Bounds bounds = Bounds::sphere,
+              bool graphicsQueue = true) {
+    Params params;
+    memcpy(params.planes, frustum.planes, sizeof(params.planes));
+    params.objectCount = objectCount;
+    params.bounds = static_cast<uint32_t>(bounds);
+    dispatchObjects(cb, objects, commands, objectCount, &params, sizeof(params), graphicsQueue, {}, true);
+  }
+
+  static bool isVisible(const IndirectObject &object, const Frustum &frustum, Bounds bounds) {
+    return bounds == Bounds::aabb ? frustum.containsAabb(object.bounds, object.extents)
+                                  : frustum.containsSphere(object.bounds, object.bounds[3]);
+  }
+
+  /// The draws the GPU pass produces, in object order.
+  static std::vector<vk::DrawIndexedIndirectCommand> cullReference(const std::vector<IndirectObject> &objects,
+                                                                   const Frustum &frustum,
+                                                                   Bounds bounds = Bounds::sphere) {
+    std::vector<vk::DrawIndexedIndirectCommand> result;
+    for (auto &object : objects)
+      if (isVisible(object, frustum, bounds))
+        result.emplace_back(object.indexCount, 1, object.firstIndex, object.vertexOffset, object.firstInstance);
+    return result;
+  }
+
+  /// Decode a copy of an indexed IndirectDrawBuffer: the count header and that many commands.
+  static std::vector<vk::DrawIndexedIndirectCommand> readCommands(const void *data) {
+    uint32_t count = 0;
+    memcpy(&count, static_cast<const uint8_t *>(data) + IndirectDrawBuffer::countOffset, sizeof(count));
+    std::vector<vk::DrawIndexedIndirectCommand> result(count);
+    if (count)
+      memcpy(result.data(), static_cast<const uint8_t *>(data) + IndirectDrawBuffer::commandsOffset,
+             count * sizeof(vk::DrawIndexedIndirectCommand));
+    return result;
+  }
+
+  /// Same draws, in any order.
+  static bool sameDraws(std::vector<vk::DrawIndexedIndirectCommand> a,
+                        std::vector<vk::DrawIndexedIndirectCommand> b) {
+    auto less = [](const vk::DrawIndexedIndirectCommand &x, const vk::DrawIndexedIndirectCommand &y) {
+      return std::make_tuple(x.firstInstance, x.firstIndex, x.indexCount, x.vertexOffset, x.instanceCount) <
+             std::make_tuple(y.firstInstance, y.firstIndex, y.indexCount, y.vertexOffset, y.instanceCount);
+    };
+    std::sort(a.begin(), a.end(), less);
+    std::sort(b.begin(), b.end(), less);
+    return a == b;
+  }
+
+private:
+  // Matches the push constants of frustum_cull.comp.
+  struct Params {
+    float planes[6][4];
+    uint32_t objectCount;
+    uint32_t bounds;
+  };
+};
+
 #pragma endregion
 
 
@@ -3006,25 +7479,40 @@ public:
 
   vk::Image image() const { return *s.image; }
   vk::ImageView imageView() const { return *s.imageView; }
-  vk::DeviceMemory mem() const { return *s.mem; }
+  vk::DeviceMemory mem() const { return s.mem->memory; }
+  const MemoryAllocation &allocation() const { return *s.mem; }
+
+  /// Destroy the image, its view and memory once the GPU is done with them.
+  /// Goes through the device's DeletionQueue, so this never stalls.
+  void release() {
+    auto &deletion = *device->deletion;
+    deletion.retire(s.imageView.release());
+    deletion.retire(s.image.release());
+    if (s.mem) {
+      auto allocator = device->allocator;
+      auto a = s.mem.release();
+      deletion.retire([allocator, a]() { allocator->free(a); });
+    }
+  }
 
   /// Clear the colour of an image.
   void clear(vk::CommandBuffer cb, const std::array<float,4> colour = {1, 1, 1, 1}) {
     setLayout(cb, vk::ImageLayout::eTransferDstOptimal);
     vk::ClearColorValue ccv(colour);
     vk::ImageSubresourceRange range{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1};
-    cb.clearColorImage(*s.image, vk::ImageLayout::eTransferDstOptimal, ccv, range);
+    cb.clearColorImage(*s.image, vk::ImageLayout::eTransferDstOptimal, ccv, range, device->dispatch());
   }
 
   /// Update the image with an array of pixels. (Currently 2D only)
   void update(const void *data, vk::DeviceSize bytesPerPixel) {
     const uint8_t *src = (const uint8_t *)data;
+    uint8_t *mapped = (uint8_t *)device->allocator->map(*s.mem);
     for (uint32_t mipLevel = 0; mipLevel != info().mipLevels; ++mipLevel) {
       // Array images are layed out horizontally. eg. [left][front][right] etc.
       for (uint32_t arrayLayer = 0; arrayLayer != info().arrayLayers; ++arrayLayer) {
         vk::ImageSubresource subresource{vk::ImageAspectFlagBits::eColor, mipLevel, arrayLayer};
         auto srlayout = (*device)->getImageSubresourceLayout(*s.image, subresource);
-        uint8_t *dest = (uint8_t *)(*device)->mapMemory(*s.mem, 0, s.size, vk::MemoryMapFlags{}) + srlayout.offset;
+        uint8_t *dest = mapped + srlayout.offset;
         size_t bytesPerLine = s.info.extent.width * bytesPerPixel;
         size_t srcStride = bytesPerLine * info().arrayLayers;
         for (int y = 0; y != s.info.extent.height; ++y) {
@@ -3034,7 +7522,6 @@ public:
         }
       }
     }
-    (*device)->unmapMemory(*s.mem);
   }
 
   /// Copy another image to this one. This also changes the layout.
@@ -3046,12 +7533,12 @@ public:
       region.srcSubresource = {vk::ImageAspectFlagBits::eColor, mipLevel, 0, 1};
       region.dstSubresource = {vk::ImageAspectFlagBits::eColor, mipLevel, 0, 1};
       region.extent = s.info.extent;
-      cb.copyImage(srcImage.image(), vk::ImageLayout::eTransferSrcOptimal, *s.image, vk::ImageLayout::eTransferDstOptimal, region);
+      cb.copyImage(srcImage.image(), vk::ImageLayout::eTransferSrcOptimal, *s.image, vk::ImageLayout::eTransferDstOptimal, region, device->dispatch());
     }
   }
 
   /// Copy a subimage in a buffer to this image.
-  void copy(vk::CommandBuffer cb, vk::Buffer buffer, uint32_t mipLevel, uint32_t arrayLayer, uint32_t width, uint32_t height, uint32_t depth, uint32_t offset) {
+  void copy(vk::CommandBuffer cb, vk::Buffer buffer, uint32_t mipLevel, uint32_t arrayLayer, uint32_t width, uint32_t height, uint32_t depth, vk::DeviceSize offset) {
     setLayout(cb, vk::ImageLayout::eTransferDstOptimal);
     vk::BufferImageCopy region{};
     region.bufferOffset = offset;
@@ -3061,7 +7548,7 @@ public:
     extent.depth = depth;
     region.imageSubresource = {vk::ImageAspectFlagBits::eColor, mipLevel, arrayLayer, 1};
     region.imageExtent = extent;
-    cb.copyBufferToImage(buffer, *s.image, vk::ImageLayout::eTransferDstOptimal, region);
+    cb.copyBufferToImage(buffer, *s.image, vk::ImageLayout::eTransferDstOptimal, region, device->dispatch());
   }
 
   void upload(vk::CommandPool commandPool, vk::Queue queue, const std::vector<uint8_t> &bytes) {
@@ -3069,25 +7556,54 @@ public:
   }
 
   void upload(vk::CommandPool commandPool, vk::Queue queue, const void *data, vk::DeviceSize sizeInBytes) {
-    GenericBuffer stagingBuffer(*device, (vk::BufferUsageFlags)vk::BufferUsageFlagBits::eTransferSrc, sizeInBytes, vk::MemoryPropertyFlagBits::eHostVisible);
-    stagingBuffer.updateLocal(data, sizeInBytes);
-
-    // Copy the staging buffer to the GPU texture and set the layout.
-    executeImmediately(device->instance, commandPool, queue, [&](vk::CommandBuffer cb) {
-      auto bp = getBlockParams(s.info.format);
-      vk::Buffer buf = stagingBuffer.buffer;
-      uint32_t offset = 0;
-      for (uint32_t mipLevel = 0; mipLevel != s.info.mipLevels; ++mipLevel) {
-        auto width = mipScale(s.info.extent.width, mipLevel);
-        auto height = mipScale(s.info.extent.height, mipLevel);
-        auto depth = mipScale(s.info.extent.depth, mipLevel);
-        for (uint32_t face = 0; face != s.info.arrayLayers; ++face) {
-          copy(cb, buf, mipLevel, face, width, height, depth, offset);
-          offset += ((bp.bytesPerBlock + 3) & ~3) * (width * height);
-        }
-      }
-      setLayout(cb, vk::ImageLayout::eShaderReadOnlyOptimal);
-    });
+    auto &ring = *device->staging;
+    auto region = stage(data, sizeInBytes);
+
+    // Copy the staging region to the GPU texture and set the layout.
+    try {
+      executeImmediately(*device, commandPool, queue, [&](vk::CommandBuffer cb) {
+        copyStaged(cb, region);
+      });
+    } catch (...) {
+      ring.retire(region);
+      throw;
+    }
+    ring.retire(region);
+  }
+
+  /// Upload without blocking, on the device's TransferEngine.
+  /// The image ends up in eShaderReadOnlyOptimal once the graphics queue acquired it, see GenericBuffer::upload.
+  SubmitToken upload(const void *data, vk::DeviceSize sizeInBytes) {
+    auto &ring = *device->staging;
+    auto &engine = *device->transfer;
+    auto region = stage(data, sizeInBytes);
+
+    TransferEngine::ImageTransfer transfer;
+    transfer.image = *s.image;
+    transfer.range = {vk::ImageAspectFlagBits::eColor, 0, s.info.mipLevels, 0, s.info.arrayLayers};
+    transfer.old_layout = vk::ImageLayout::eTransferDstOptimal;
+    transfer.new_layout = vk::ImageLayout::eShaderReadOnlyOptimal;
+
+    // Every texel is overwritten, so the old contents (and their owner queue) don't matter.
+    vk::ImageLayout oldLayout = s.currentLayout;
+    s.currentLayout = vk::ImageLayout::eUndefined;
+    SubmitToken token;
+    try {
+      token = engine.submit([&](vk::CommandBuffer cb) {
+        copyStaged(cb, region, false);
+      }, {}, {transfer});
+    } catch (...) {
+      s.currentLayout = oldLayout;
+      ring.retire(region);
+      throw;
+    }
+    s.currentLayout = transfer.new_layout;
+    ring.retire(region, engine.get_context().get(), token);
+    return token;
+  }
+
+  SubmitToken upload(const std::vector<uint8_t> &bytes) {
+    return upload(bytes.data(), bytes.size());
   }
 
   /// Change the layout of this image using a memory barrier.
@@ -3147,7 +7663,7 @@ public:
     imageMemoryBarriers.dstAccessMask = dstMask;
     auto memoryBarriers = nullptr;
     auto bufferMemoryBarriers = nullptr;
-    cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, memoryBarriers, bufferMemoryBarriers, imageMemoryBarriers);
+    cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, memoryBarriers, bufferMemoryBarriers, imageMemoryBarriers, device->dispatch());
   }
 
   /// Set what the image thinks is its current layout (ie. the old layout in an image barrier).
@@ -3159,6 +7675,33 @@ public:
   vk::Extent3D extent() const { return s.info.extent; }
   const vk::ImageCreateInfo &info() const { return s.info; }
 protected:
+  /// Copy pixels into the device's staging ring.
+  StagingRing::Region stage(const void *data, vk::DeviceSize sizeInBytes) {
+    // Buffer offsets of image copies must be a multiple of 4 and of the texel size.
+    auto bp = getBlockParams(s.info.format);
+    auto region = device->staging->allocate(sizeInBytes, bp.bytesPerBlock ? 4 * bp.bytesPerBlock : 16);
+    memcpy(region.data, data, (size_t)sizeInBytes);
+    return region;
+  }
+
+  /// Record the copy of every mip level and layer out of a staging region.
+  /// With `readOnlyLayout` the image is then moved to eShaderReadOnlyOptimal, otherwise it stays in eTransferDstOptimal.
+  void copyStaged(vk::CommandBuffer cb, const StagingRing::Region &region, bool readOnlyLayout = true) {
+    auto bp = getBlockParams(s.info.format);
+    vk::DeviceSize offset = region.offset;
+    for (uint32_t mipLevel = 0; mipLevel != s.info.mipLevels; ++mipLevel) {
+      auto width = mipScale(s.info.extent.width, mipLevel);
+      auto height = mipScale(s.info.extent.height, mipLevel);
+      auto depth = mipScale(s.info.extent.depth, mipLevel);
+      for (uint32_t face = 0; face != s.info.arrayLayers; ++face) {
+        copy(cb, region.buffer, mipLevel, face, width, height, depth, offset);
+        offset += ((bp.bytesPerBlock + 3) & ~3) * (width * height);
+      }
+    }
+    if (readOnlyLayout)
+      setLayout(cb, vk::ImageLayout::eShaderReadOnlyOptimal);
+  }
+
   void create(vkb::Device& device, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask, bool hostImage) {
     this->device = &device;
     s.currentLayout = info.initialLayout;
@@ -3170,14 +7713,13 @@ protected:
     vk::MemoryPropertyFlags search{};
     if (hostImage) search = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
 
-    // Create a memory object to bind to the buffer.
+    // Take a range out of one of the device's memory blocks.
     // Note: we don't expect to be able to map the buffer.
-    vk::MemoryAllocateInfo mai{};
-    mai.allocationSize = s.size = memreq.size;
-    mai.memoryTypeIndex = device.physical_device.findMemoryTypeIndex(memreq.memoryTypeBits, search);
-    s.mem = device->allocateMemoryUnique(mai);
+    s.size = memreq.size;
+    bool linear = info.tiling == vk::ImageTiling::eLinear;
+    s.mem = UniqueMemoryAllocation(device.allocator, device.allocator->allocate(memreq, search, linear));
 
-    device->bindImageMemory(*s.image, *s.mem, 0);
+    device->bindImageMemory(*s.image, s.mem->memory, s.mem->offset);
 
     if (!hostImage) {
       vk::ImageViewCreateInfo viewInfo{};
@@ -3193,7 +7735,7 @@ protected:
   struct State {
     vk::UniqueImage image;
     vk::UniqueImageView imageView;
-    vk::UniqueDeviceMemory mem;
+    UniqueMemoryAllocation mem;
     vk::DeviceSize size;
     vk::ImageLayout currentLayout;
     vk::ImageCreateInfo info;
@@ -3306,6 +7848,397 @@ public:
   }
 };
 
+/// Hierarchical depth of a DepthStencilImage, for occlusion culling (see OcclusionCullPass). Mip 0 has
+/// the previous power of two size of the depth image and holds the farthest depth of the texels each of
+/// its texels covers, every further mip the farthest of the 2x2 texels below. Assumes a depth test of
+/// less or less-or-equal, i.e. 1 is far.
+///
+/// build() records a compute downsample, one dispatch per mip, from shader/hiz_downsample.comp compiled
+/// to hiz_downsample.spv by the build. The pyramid is left in eGeneral.
+class HiZPyramid : public GenericImage {
+public:
+  HiZPyramid() {}
+  HiZPyramid(Device& device, uint32_t depthWidth, uint32_t depthHeight, const std::string& shaderPath = "hiz_downsample.spv") {
+    create(device, depthWidth, depthHeight, shaderPath);
+  }
+
+  void create(Device& device, uint32_t depthWidth, uint32_t depthHeight, const std::string& shaderPath = "hiz_downsample.spv") {
+    auto previousPow2 = [](uint32_t v) {
+      uint32_t r = 1;
+      while (r * 2 <= v) r *= 2;
+      return r;
+    };
+    width = previousPow2(std::max(depthWidth, 1u));
+    height = previousPow2(std::max(depthHeight, 1u));
+    uint32_t levels = 1;
+    while ((std::max(width, height) >> levels) > 0) levels++;
+
+    vk::ImageCreateInfo info;
+    info.imageType = vk::ImageType::e2D;
+    info.format = vk::Format::eR32Sfloat;
+    info.extent = vk::Extent3D{ width, height, 1U };
+    info.mipLevels = levels;
+    info.arrayLayers = 1;
+    info.samples = vk::SampleCountFlagBits::e1;
+    info.tiling = vk::ImageTiling::eOptimal;
+    info.usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc;
+    info.sharingMode = vk::SharingMode::eExclusive;
+    info.initialLayout = vk::ImageLayout::eUndefined;
+    GenericImage::create(device, info, vk::ImageViewType::e2D, vk::ImageAspectFlagBits::eColor, false);
+
+    for (uint32_t level = 0; level < levels; ++level) {
+      vk::ImageViewCreateInfo viewInfo{};
+      viewInfo.image = image();
+      viewInfo.viewType = vk::ImageViewType::e2D;
+      viewInfo.format = info.format;
+      viewInfo.subresourceRange = vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, level, 1, 0, 1};
+      mipViews.push_back(device->createImageView(viewInfo, device.allocation_callbacks));
+    }
+
+    // Nearest filtering: the shaders take the max of the texels themselves.
+    vk::SamplerCreateInfo samplerInfo;
+    samplerInfo.magFilter = vk::Filter::eNearest;
+    samplerInfo.minFilter = vk::Filter::eNearest;
+    samplerInfo.mipmapMode = vk::SamplerMipmapMode::eNearest;
+    samplerInfo.addressModeU = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.addressModeV = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.addressModeW = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.maxLod = float(levels);
+    pyramidSampler = device->createSampler(samplerInfo, device.allocation_callbacks);
+
+    downsampleLayout = device.layouts->getDescriptorSetLayout({
+      {0, vk::DescriptorType::eCombinedImageSampler, 1, vk::ShaderStageFlagBits::eCompute},
+      {1, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute},
+    });
+    ComputePipelineBuilder builder{device};
+    pipeline = builder.setShader(shaderPath)
+                      .addDescriptorSetLayout(downsampleLayout)
+                      .addPushConstantRange(0, 4 * sizeof(int32_t))
+                      .build();
+    pipelineLayout = builder.getLayout();
+
+    // Mip n reads mip n-1, these sets never change.
+    mipSets.push_back(vk::DescriptorSet());
+    for (uint32_t level = 1; level < levels; ++level)
+      mipSets.push_back(makeSet(mipViews[level - 1], vk::ImageLayout::eGeneral, level, pools, setsLeft));
+  }
+
+  /// Record the downsample of `depth`, which must hold the finished depth of a frame in
+  /// eDepthStencilAttachmentOptimal. It is left in eShaderReadOnlyOptimal, call restoreDepth() before
+  /// depth testing into it again.
+  void build(vk::CommandBuffer cb, DepthStencilImage &depth) {
+    auto &d = device->dispatch();
+    vk::ImageAspectFlags depthAspect = depthAspects(depth.format());
+
+    vk::ImageMemoryBarrier barriers[2];
+    barriers[0].srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    barriers[0].dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    barriers[0].oldLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    barriers[0].newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[0].image = depth.image();
+    barriers[0].subresourceRange = {depthAspect, 0, 1, 0, 1};
+    // The previous contents are not needed, only the reads of the last cull have to finish.
+    barriers[1].srcAccessMask = vk::AccessFlags{};
+    barriers[1].dstAccessMask = vk::AccessFlagBits::eShaderWrite;
+    barriers[1].oldLayout = vk::ImageLayout::eUndefined;
+    barriers[1].newLayout = vk::ImageLayout::eGeneral;
+    barriers[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[1].image = image();
+    barriers[1].subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, levels(), 0, 1};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests |
+                       vk::PipelineStageFlagBits::eComputeShader,
+                       vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags{},
+                       0, nullptr, 0, nullptr, 2, barriers, d);
+    depth.setCurrentLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+    setCurrentLayout(vk::ImageLayout::eGeneral);
+
+    vk::ImageView depthView = depth.imageView();
+    auto it = depthSets.find((uint64_t)static_cast<VkImageView>(depthView));
+    if (it == depthSets.end())
+      it = depthSets.emplace((uint64_t)static_cast<VkImageView>(depthView),
+                             makeSet(depthView, vk::ImageLayout::eShaderReadOnlyOptimal, 0,
+                                     depthPools, depthSetsLeft)).first;
+
+    cb.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline, d);
+    int32_t srcSize[2] = { int32_t(depth.extent().width), int32_t(depth.extent().height) };
+    for (uint32_t level = 0; level < levels(); ++level) {
+      int32_t params[4] = { srcSize[0], srcSize[1], int32_t(mipScale(width, level)), int32_t(mipScale(height, level)) };
+      vk::DescriptorSet set = level == 0 ? it->second : mipSets[level];
+      cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, pipelineLayout, 0, 1, &set, 0, nullptr, d);
+      cb.pushConstants(pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(params), params, d);
+      cb.dispatch((params[2] + 7) / 8, (params[3] + 7) / 8, 1, d);
+
+      vk::ImageMemoryBarrier written;
+      written.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+      written.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+      written.oldLayout = vk::ImageLayout::eGeneral;
+      written.newLayout = vk::ImageLayout::eGeneral;
+      written.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      written.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      written.image = image();
+      written.subresourceRange = {vk::ImageAspectFlagBits::eColor, level, 1, 0, 1};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader,
+                         vk::DependencyFlags{}, 0, nullptr, 0, nullptr, 1, &written, d);
+      srcSize[0] = params[2];
+      srcSize[1] = params[3];
+    }
+  }
+
+  /// Move `depth` back to eDepthStencilAttachmentOptimal after build(), so that a later render pass can
+  /// depth test against it. That render pass must load the depth (vk::AttachmentLoadOp::eLoad) and
+  /// start from eDepthStencilAttachmentOptimal.
+  void restoreDepth(vk::CommandBuffer cb, DepthStencilImage &depth) {
+    vk::ImageMemoryBarrier barrier;
+    barrier.srcAccessMask = vk::AccessFlagBits::eShaderRead;
+    barrier.dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    barrier.oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    barrier.newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = depth.image();
+    barrier.subresourceRange = {depthAspects(depth.format()), 0, 1, 0, 1};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                       vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests,
+                       vk::DependencyFlags{}, 0, nullptr, 0, nullptr, 1, &barrier, device->dispatch());
+    depth.setCurrentLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
+  }
+
+  /// Drop the descriptor sets made for depth images, e.g. when they are recreated on resize. Their
+  /// pools are destroyed once the GPU is done with them.
+  void clearDepthSets() {
+    for (auto pool : depthPools)
+      device->deletion->retire(pool);
+    depthPools.clear();
+    depthSetsLeft = 0;
+    depthSets.clear();
+  }
+
+  /// Destroy the pyramid and everything built with it once the GPU is done with them.
+  void release() {
+    if (!pipeline)
+      return;
+    auto &deletion = *device->deletion;
+    for (auto view : mipViews)
+      deletion.retire(view);
+    for (auto pool : pools)
+      deletion.retire(pool);
+    clearDepthSets();
+    deletion.retire(pyramidSampler);
+    deletion.retire(pipeline);
+    pipeline = vk::Pipeline();
+    mipViews.clear();
+    pools.clear();
+    mipSets.clear();
+    setsLeft = 0;
+    GenericImage::release();
+  }
+
+  uint32_t levels() const { return info().mipLevels; }
+  vk::Extent2D size() const { return vk::Extent2D{ width, height }; }
+  vk::Sampler sampler() const { return pyramidSampler; }
+
+private:
+  static vk::ImageAspectFlags depthAspects(vk::Format format) {
+    if (format == vk::Format::eD16UnormS8Uint || format == vk::Format::eD24UnormS8Uint || format == vk::Format::eD32SfloatS8Uint)
+      return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+    return vk::ImageAspectFlagBits::eDepth;
+  }
+
+  vk::DescriptorSet makeSet(vk::ImageView src, vk::ImageLayout srcLayout, uint32_t level,
+                            std::vector<vk::DescriptorPool> &fromPools, uint32_t &left) {
+    if (left == 0) {
+      vk::DescriptorPoolSize sizes[2] = {
+        {vk::DescriptorType::eCombinedImageSampler, setsPerPool},
+        {vk::DescriptorType::eStorageImage, setsPerPool},
+      };
+      vk::DescriptorPoolCreateInfo info{vk::DescriptorPoolCreateFlags{}, setsPerPool, 2, sizes};
+      fromPools.push_back((*device)->createDescriptorPool(info, device->allocation_callbacks));
+      left = setsPerPool;
+    }
+    vk::DescriptorSetAllocateInfo info{fromPools.back(), 1, &downsampleLayout};
+    vk::DescriptorSet set = (*device)->allocateDescriptorSets(info)[0];
+    left--;
+
+    vk::DescriptorImageInfo srcInfo{pyramidSampler, src, srcLayout};
+    vk::DescriptorImageInfo dstInfo{vk::Sampler(), mipViews[level], vk::ImageLayout::eGeneral};
+    vk::WriteDescriptorSet writes[2];
+    writes[0].dstSet = set;
+    writes[0].dstBinding = 0;
+    writes[0].descriptorCount = 1;
+    writes[0].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+    writes[0].pImageInfo = &srcInfo;
+    writes[1].dstSet = set;
+    writes[1].dstBinding = 1;
+    writes[1].descriptorCount = 1;
+    writes[1].descriptorType = vk::DescriptorType::eStorageImage;
+    writes[1].pImageInfo = &dstInfo;
+    (*device)->updateDescriptorSets(2, writes, 0, nullptr);
+    return set;
+  }
+
+  static constexpr uint32_t setsPerPool = 16;
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<vk::ImageView> mipViews;
+  vk::Sampler pyramidSampler;
+  vk::DescriptorSetLayout downsampleLayout;
+  vk::PipelineLayout pipelineLayout;
+  vk::Pipeline pipeline;
+  std::vector<vk::DescriptorPool> pools;
+  uint32_t setsLeft = 0;
+  std::vector<vk::DescriptorSet> mipSets;
+  // Sets reading depth images, kept apart so clearDepthSets() can drop their pools.
+  std::vector<vk::DescriptorPool> depthPools;
+  uint32_t depthSetsLeft = 0;
+  std::map<uint64_t, vk::DescriptorSet> depthSets;
+};
+
+/// Frustum and occlusion culling of IndirectObjects against a HiZPyramid, from
+/// shader/occlusion_cull.comp compiled to occlusion_cull.spv by the build. The bounding box of each
+/// object (the sphere's box when `extents` is 0) is projected with the view-projection matrix and
+/// its nearest depth compared with the farthest depth of the pyramid over its footprint.
+///
+/// `visibility` holds one uint per object, whether it was visible in the last late phase. Clear it
+/// once with resetVisibility. The phases:
+///  - single: cull against the pyramid of the previous frame. Objects that become visible only show
+///    up a frame later.
+///  - early: draw the objects visible last frame that are in the frustum, no occlusion test. Build
+///    the pyramid from the depth they leave.
+///  - late: test every object against that pyramid, draw the visible ones the early phase missed
+///    (disocclusion), and store the visibility for the next frame.
+/// Each phase needs its own IndirectDrawBuffer.
+///
+/// A two phase frame records: early cull, a render pass drawing the early commands that stores its
+/// depth, HiZPyramid::build, late cull, HiZPyramid::restoreDepth, then a second render pass drawing
+/// the late commands that loads colour and depth (vk::AttachmentLoadOp::eLoad, initial layouts
+/// eColorAttachmentOptimal and eDepthStencilAttachmentOptimal).
+class OcclusionCullPass : public IndirectComputePass {
+public:
+  enum class Phase : uint32_t { single = 0, early = 1, late = 2 };
+
+  OcclusionCullPass() {}
+  OcclusionCullPass(vkb::Device& device, const std::string& shaderPath = "occlusion_cull.spv") {
+    create(device, shaderPath);
+  }
+
+  void create(vkb::Device& device, const std::string& shaderPath = "occlusion_cull.spv") {
+    cullLayout = device.layouts->getDescriptorSetLayout({
+      {0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute},
+      {1, vk::DescriptorType::eCombinedImageSampler, 1, vk::ShaderStageFlagBits::eCompute},
+    });
+    createPass(device, shaderPath, sizeof(Params), {cullLayout});
+  }
+
+  /// Mark every object invisible, e.g. before the first frame.
+  void resetVisibility(vk::CommandBuffer cb, const GenericBuffer &visibility) {
+    auto &d = device->dispatch();
+    cb.fillBuffer(visibility.buffer, 0, VK_WHOLE_SIZE, 0, d);
+    vk::BufferMemoryBarrier cleared{vk::AccessFlagBits::eTransferWrite,
+                                    vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                    VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, visibility.buffer, 0, VK_WHOLE_SIZE};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader,
+                       vk::DependencyFlags{}, 0, nullptr, 1, &cleared, 0, nullptr, d);
+  }
+
+  /// Record one phase. `viewProjection` is the column major matrix of the frame being drawn. See
+  /// IndirectFillPass::record for `graphicsQueue`.
+  void record(vk::CommandBuffer cb, const GenericBuffer &objects, const IndirectDrawBuffer &commands,
+              const GenericBuffer &visibility, uint32_t objectCount, const float *viewProjection,
+              HiZPyramid &pyramid, Phase phase, bool graphicsQueue = true) {
+    auto &d = device->dispatch();
+    // The last phase's visibility writes, in this or the previous frame.
+    vk::BufferMemoryBarrier written{vk::AccessFlagBits::eShaderWrite,
+                                    vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                    VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, visibility.buffer, 0, VK_WHOLE_SIZE};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader,
+                       vk::DependencyFlags{}, 0, nullptr, 1, &written, 0, nullptr, d);
+
+    Params params;
+    memcpy(params.viewProjection, viewProjection, sizeof(params.viewProjection));
+    params.pyramidSize[0] = float(pyramid.size().width);
+    params.pyramidSize[1] = float(pyramid.size().height);
+    params.objectCount = objectCount;
+    params.phase = static_cast<uint32_t>(phase);
+    dispatchObjects(cb, objects, commands, objectCount, &params, sizeof(params), graphicsQueue,
+                    {getCullSet(visibility.buffer, pyramid)}, true);
+  }
+
+  /// Drop every cached descriptor set once the GPU is done with them.
+  void clearSets() {
+    IndirectComputePass::clearSets();
+    for (auto pool : cullPools)
+      device->deletion->retire(pool);
+    cullPools.clear();
+    cullSets.clear();
+    cullSetsLeft = 0;
+  }
+
+  void release() {
+    if (!device)
+      return;
+    clearSets();
+    IndirectComputePass::release();
+  }
+
+private:
+  // Matches the push constants of occlusion_cull.comp.
+  struct Params {
+    float viewProjection[16];
+    float pyramidSize[2];
+    uint32_t objectCount;
+    uint32_t phase;
+  };
+
+  vk::DescriptorSet getCullSet(vk::Buffer visibility, HiZPyramid &pyramid) {
+    auto key = std::make_pair((uint64_t)static_cast<VkBuffer>(visibility),
+                              (uint64_t)static_cast<VkImageView>(pyramid.imageView()));
+    auto it = cullSets.find(key);
+    if (it != cullSets.end())
+      return it->second;
+
+    if (cullSetsLeft == 0) {
+      vk::DescriptorPoolSize sizes[2] = {
+        {vk::DescriptorType::eStorageBuffer, setsPerPool},
+        {vk::DescriptorType::eCombinedImageSampler, setsPerPool},
+      };
+      vk::DescriptorPoolCreateInfo info{vk::DescriptorPoolCreateFlags{}, setsPerPool, 2, sizes};
+      cullPools.push_back((*device)->createDescriptorPool(info, device->allocation_callbacks));
+      cullSetsLeft = setsPerPool;
+    }
+    vk::DescriptorSetAllocateInfo info{cullPools.back(), 1, &cullLayout};
+    vk::DescriptorSet set = (*device)->allocateDescriptorSets(info)[0];
+    cullSetsLeft--;
+
+    vk::DescriptorBufferInfo bufferInfo{visibility, 0, VK_WHOLE_SIZE};
+    vk::DescriptorImageInfo imageInfo{pyramid.sampler(), pyramid.imageView(), vk::ImageLayout::eGeneral};
+    vk::WriteDescriptorSet writes[2];
+    writes[0].dstSet = set;
+    writes[0].dstBinding = 0;
+    writes[0].descriptorCount = 1;
+    writes[0].descriptorType = vk::DescriptorType::eStorageBuffer;
+    writes[0].pBufferInfo = &bufferInfo;
+    writes[1].dstSet = set;
+    writes[1].dstBinding = 1;
+    writes[1].descriptorCount = 1;
+    writes[1].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+    writes[1].pImageInfo = &imageInfo;
+    (*device)->updateDescriptorSets(2, writes, 0, nullptr);
+    cullSets.emplace(key, set);
+    return set;
+  }
+
+  static constexpr uint32_t setsPerPool = 16;
+
+  vk::DescriptorSetLayout cullLayout;
+  std::vector<vk::DescriptorPool> cullPools;
+  uint32_t cullSetsLeft = 0;
+  std::map<std::pair<uint64_t, uint64_t>, vk::DescriptorSet> cullSets;
+};
+
 /// A class to help build samplers.
 /// Samplers tell the shader stages how to sample an image.
 /// They are used in combination with an image to make a combined image sampler
@@ -3525,6 +8458,12 @@ public:
     return *this;
   }
 
+  /// Get the layout from the device's LayoutCache. Equal binding lists share
+  /// one layout, which is owned by the device.
+  vk::DescriptorSetLayout build(const Device &device) const {
+    return device.layouts->getDescriptorSetLayout(s.bindings);
+  }
+
   /// Create a self-deleting descriptor set object.
   vk::UniqueDescriptorSetLayout createUnique(vk::Device device) const {
     vk::DescriptorSetLayoutCreateInfo dsci{};
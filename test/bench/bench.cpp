@@ -0,0 +1,425 @@
+// Headless micro benchmarks for the device services. Run from the build
+// directory, next to vert.spv and frag.spv:
+//
+//   vkb_bench [frames] [draws]
+//
+// Measures
+// - frame throughput with two frames in flight vs idling the device after
+//   every frame,
+// - device startup with a cold and a warm pipeline cache,
+// - PipelineBatchBuilder compile time over thread counts,
+// - vkCmdDraw cost through the device dispatch table vs the global one,
+// - buffer creation through the MemoryAllocator vs one vkAllocateMemory per
+//   buffer.
+//
+// Drivers keep shader caches of their own, disable them for meaningful cold
+// numbers (e.g. MESA_SHADER_CACHE_DISABLE=true).
+#define VKB_IMPL
+#include "vkbuilder.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Vertex {
+  float pos[2];
+  float color[3];
+
+  static vk::VertexInputBindingDescription
+  getBindingDescription(uint32_t binding) {
+    return vk::VertexInputBindingDescription(binding, sizeof(Vertex), vk::VertexInputRate::eVertex);
+  }
+  static std::vector<vk::VertexInputAttributeDescription>
+  getAttributeDescription(uint32_t binding) {
+    return {
+      vk::VertexInputAttributeDescription(0, binding, vk::Format::eR32G32Sfloat, offsetof(Vertex, pos)),
+      vk::VertexInputAttributeDescription(1, binding, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, color))
+    };
+  }
+};
+
+using Clock = std::chrono::steady_clock;
+
+template<class Func>
+double millis(Func &&func) {
+  auto start = Clock::now();
+  func();
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static const uint32_t width = 256, height = 256;
+static const vk::Format format = vk::Format::eR8G8B8A8Unorm;
+
+static vk::RenderPass createRenderPass(vkb::Device &device) {
+  vkb::RenderPassBuilder builder{device};
+  return builder
+      .addColorAttachment(format, vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eStore)
+      .addSubpass(vkb::SubpassBuilder()
+        .addAttachmentRef(0, vk::ImageLayout::eColorAttachmentOptimal))
+      .addDependency(VK_SUBPASS_EXTERNAL, 0)
+      .build();
+}
+
+// `count` builders for pipelines that differ in their blend state, which
+// drivers compile into the fragment shader, so no two are the same program.
+struct PipelineSet {
+  // PipelineBuilder takes the viewport from a swapchain, only its extent is
+  // used.
+  vkb::Swapchain swapchain;
+  vkb::VertexInputStateBuilder input;
+  std::vector<vk::PipelineColorBlendAttachmentState> attachments;
+  std::vector<std::unique_ptr<vkb::PipelineBuilder>> builders;
+
+  PipelineSet(vkb::Device &device, uint32_t count) {
+    static const vk::BlendFactor factors[] = {
+      vk::BlendFactor::eZero, vk::BlendFactor::eOne, vk::BlendFactor::eSrcColor,
+      vk::BlendFactor::eOneMinusSrcColor, vk::BlendFactor::eDstColor, vk::BlendFactor::eOneMinusDstColor,
+      vk::BlendFactor::eSrcAlpha, vk::BlendFactor::eOneMinusSrcAlpha, vk::BlendFactor::eDstAlpha,
+      vk::BlendFactor::eOneMinusDstAlpha, vk::BlendFactor::eSrcAlphaSaturate,
+    };
+    static const vk::BlendOp ops[] = {
+      vk::BlendOp::eAdd, vk::BlendOp::eSubtract, vk::BlendOp::eReverseSubtract, vk::BlendOp::eMin, vk::BlendOp::eMax,
+    };
+    const uint32_t factorCount = sizeof(factors) / sizeof(factors[0]);
+
+    swapchain.image_format = format;
+    swapchain.extent = vk::Extent2D{width, height};
+    input.addInputBinding<Vertex>().addAttributeDescription<Vertex>();
+    attachments.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      auto &attachment = attachments[i];
+      attachment.blendEnable = true;
+      attachment.srcColorBlendFactor = factors[i % factorCount];
+      attachment.dstColorBlendFactor = factors[(i / factorCount) % factorCount];
+      attachment.colorBlendOp = ops[(i / (factorCount * factorCount)) % 5];
+      attachment.srcAlphaBlendFactor = vk::BlendFactor::eOne;
+      attachment.dstAlphaBlendFactor = vk::BlendFactor::eZero;
+      attachment.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+                                  vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+
+      vk::PipelineColorBlendStateCreateInfo blending;
+      blending.attachmentCount = 1;
+      blending.pAttachments = &attachment;
+
+      builders.emplace_back(new vkb::PipelineBuilder(device, swapchain));
+      builders.back()->useClassicPipeline("vert.spv", "frag.spv")
+          .setVertexInputState(input)
+          .setColorBlending(blending);
+    }
+  }
+
+  std::vector<vk::Pipeline> build(vkb::Device &device, vk::RenderPass renderpass, uint32_t threads = 1) {
+    vkb::PipelineBatchBuilder batch{device};
+    for (auto &builder : builders)
+      batch.add(*builder, renderpass);
+    std::vector<vk::Pipeline> pipelines;
+    for (auto &result : batch.set_thread_count(threads).build()) {
+      if (!result)
+        throw std::runtime_error(result.error);
+      pipelines.push_back(result.pipeline);
+    }
+    return pipelines;
+  }
+};
+
+static void destroyPipelines(vkb::Device &device, const std::vector<vk::Pipeline> &pipelines) {
+  for (auto pipeline : pipelines)
+    device->destroyPipeline(pipeline, device.allocation_callbacks);
+}
+
+// One render pass drawing a triangle into an offscreen image. Made of plain
+// Vulkan objects, so only the parts under test go through the library.
+struct Target {
+  vk::RenderPass renderpass;
+  vk::Image image;
+  vk::ImageView view;
+  vk::Framebuffer framebuffer;
+  vk::Buffer vertices;
+  std::vector<vk::DeviceMemory> memory;
+  vk::Pipeline pipeline;
+
+  void create(vkb::Device &device) {
+    auto callbacks = device.allocation_callbacks;
+    renderpass = createRenderPass(device);
+
+    vk::ImageCreateInfo info;
+    info.imageType = vk::ImageType::e2D;
+    info.format = format;
+    info.extent = vk::Extent3D{width, height, 1};
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.usage = vk::ImageUsageFlagBits::eColorAttachment;
+    image = device->createImage(info, callbacks);
+    device->bindImageMemory(image, allocate(device, device->getImageMemoryRequirements(image),
+                                            vk::MemoryPropertyFlagBits::eDeviceLocal), 0);
+
+    vk::ImageViewCreateInfo viewInfo{vk::ImageViewCreateFlags{}, image, vk::ImageViewType::e2D, format,
+                                     vk::ComponentMapping{},
+                                     vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}};
+    view = device->createImageView(viewInfo, callbacks);
+    vk::FramebufferCreateInfo framebufferInfo{vk::FramebufferCreateFlags{}, renderpass, 1, &view, width, height, 1};
+    framebuffer = device->createFramebuffer(framebufferInfo, callbacks);
+
+    Vertex v[3] = {
+      {{0.0f, 0.5f}, {1, 0, 0}}, {{-0.5f, -0.5f}, {0, 1, 0}}, {{0.5f, -0.5f}, {0, 0, 1}},
+    };
+    vertices = device->createBuffer(vk::BufferCreateInfo{vk::BufferCreateFlags{}, sizeof(v),
+                                                         vk::BufferUsageFlagBits::eVertexBuffer}, callbacks);
+    vk::DeviceMemory vertexMemory = allocate(device, device->getBufferMemoryRequirements(vertices),
+                                             vk::MemoryPropertyFlagBits::eHostVisible |
+                                             vk::MemoryPropertyFlagBits::eHostCoherent);
+    device->bindBufferMemory(vertices, vertexMemory, 0);
+    memcpy(device->mapMemory(vertexMemory, 0, sizeof(v)), v, sizeof(v));
+    device->unmapMemory(vertexMemory);
+
+    PipelineSet set{device, 1};
+    pipeline = set.build(device, renderpass)[0];
+  }
+
+  vk::DeviceMemory allocate(vkb::Device &device, const vk::MemoryRequirements &requirements,
+                            vk::MemoryPropertyFlags flags) {
+    int type = vkb::GenericBuffer::findMemoryTypeIndex(device.physical_device.memory_properties,
+                                                       requirements.memoryTypeBits, flags);
+    if (type < 0)
+      throw std::runtime_error("no_memory_type");
+    memory.push_back(device->allocateMemory(vk::MemoryAllocateInfo{requirements.size, uint32_t(type)},
+                                            device.allocation_callbacks));
+    return memory.back();
+  }
+
+  void begin(vk::CommandBuffer cb, const vk::DispatchLoaderDynamic &d = VULKAN_HPP_DEFAULT_DISPATCHER) {
+    cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit}, d);
+    vk::ClearValue clear{vk::ClearColorValue(std::array<float, 4>{0, 0, 0, 1})};
+    vk::RenderPassBeginInfo info{renderpass, framebuffer, vk::Rect2D{{0, 0}, {width, height}}, 1, &clear};
+    cb.beginRenderPass(info, vk::SubpassContents::eInline, d);
+    cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline, d);
+    vk::DeviceSize offset = 0;
+    cb.bindVertexBuffers(0, 1, &vertices, &offset, d);
+  }
+
+  void end(vk::CommandBuffer cb, const vk::DispatchLoaderDynamic &d = VULKAN_HPP_DEFAULT_DISPATCHER) {
+    cb.endRenderPass(d);
+    cb.end(d);
+  }
+
+  // The device must be idle.
+  void destroy(vkb::Device &device) {
+    auto callbacks = device.allocation_callbacks;
+    device->destroyPipeline(pipeline, callbacks);
+    device->destroyFramebuffer(framebuffer, callbacks);
+    device->destroyImageView(view, callbacks);
+    device->destroyImage(image, callbacks);
+    device->destroyBuffer(vertices, callbacks);
+    for (auto m : memory)
+      device->freeMemory(m, callbacks);
+    device->destroyRenderPass(renderpass, callbacks);
+  }
+};
+
+static void benchAllocations(vkb::Device &device, uint32_t count, vk::DeviceSize size) {
+  const vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eStorageBuffer;
+  const vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eDeviceLocal;
+
+  std::vector<vkb::GenericBuffer> buffers(count);
+  double allocated = millis([&] {
+    for (auto &buffer : buffers)
+      buffer.allocate(device, usage, size, flags);
+  });
+  double freed = millis([&] {
+    for (auto &buffer : buffers)
+      buffer.release();
+    device.deletion->flush();
+  });
+  printf("allocation  sub-allocated:    %8.2f us create, %8.2f us destroy per buffer\n",
+         allocated * 1000 / count, freed * 1000 / count);
+
+  // One buffer at a time, the pattern of short lived staging or scratch
+  // buffers.
+  double cycled = millis([&] {
+    for (uint32_t i = 0; i < count; ++i) {
+      vkb::GenericBuffer buffer(device, usage, size, flags);
+      buffer.release();
+      device.deletion->flush();
+    }
+  });
+  printf("allocation  sub-allocated:    %8.2f us create and destroy, one at a time\n",
+         cycled * 1000 / count);
+
+  std::vector<vk::Buffer> raw(count);
+  std::vector<vk::DeviceMemory> memory(count);
+  auto create = [&](uint32_t i) {
+    raw[i] = device->createBuffer(vk::BufferCreateInfo{vk::BufferCreateFlags{}, size, usage},
+                                  device.allocation_callbacks);
+    auto requirements = device->getBufferMemoryRequirements(raw[i]);
+    int type = vkb::GenericBuffer::findMemoryTypeIndex(device.physical_device.memory_properties,
+                                                       requirements.memoryTypeBits, flags);
+    memory[i] = device->allocateMemory(vk::MemoryAllocateInfo{requirements.size, uint32_t(type)},
+                                       device.allocation_callbacks);
+    device->bindBufferMemory(raw[i], memory[i], 0);
+  };
+  auto destroy = [&](uint32_t i) {
+    device->destroyBuffer(raw[i], device.allocation_callbacks);
+    device->freeMemory(memory[i], device.allocation_callbacks);
+  };
+  allocated = millis([&] {
+    for (uint32_t i = 0; i < count; ++i)
+      create(i);
+  });
+  freed = millis([&] {
+    for (uint32_t i = 0; i < count; ++i)
+      destroy(i);
+  });
+  printf("allocation  vkAllocateMemory: %8.2f us create, %8.2f us destroy per buffer\n",
+         allocated * 1000 / count, freed * 1000 / count);
+
+  cycled = millis([&] {
+    for (uint32_t i = 0; i < count; ++i) {
+      create(0);
+      destroy(0);
+    }
+  });
+  printf("allocation  vkAllocateMemory: %8.2f us create and destroy, one at a time\n",
+         cycled * 1000 / count);
+}
+
+// Frames recorded and submitted the way Present does it: each frame slot
+// owns a command buffer and a fence, and only the slot about to be reused is
+// waited on. With `idle` the device is idled after every submit instead, as
+// Present did before frames in flight.
+static void benchFrames(vkb::Device &device, Target &target, uint32_t count) {
+  const uint32_t slots = 2;
+  vk::Queue queue = device.getQueue(vkb::QueueType::graphics);
+  vk::CommandPool pool = device.createCommandPool();
+  auto cbs = device.createCommandBuffers(pool, slots);
+  for (bool idle : {false, true}) {
+    auto fences = device.createFences(slots);
+    double ms = millis([&] {
+      for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = i % slots;
+        if (device->waitForFences(1, &fences[slot], true, UINT64_MAX) != vk::Result::eSuccess)
+          throw std::runtime_error("failed_wait_for_fences");
+        device->resetFences(1, &fences[slot]);
+
+        vk::CommandBuffer cb = cbs[slot];
+        target.begin(cb);
+        cb.draw(3, 1, 0, 0);
+        target.end(cb);
+
+        vk::SubmitInfo submit;
+        submit.commandBufferCount = 1;
+        submit.pCommandBuffers = &cb;
+        if (queue.submit(1, &submit, fences[slot]) != vk::Result::eSuccess)
+          throw std::runtime_error("failed_queue_submit");
+        if (idle)
+          device->waitIdle();
+      }
+      device->waitIdle();
+    });
+    printf("frames      %-18s %8.0f frames/s\n", idle ? "waitIdle:" : "2 in flight:", count * 1000 / ms);
+    for (auto fence : fences)
+      device->destroyFence(fence);
+  }
+  device->destroyCommandPool(pool, device.allocation_callbacks);
+}
+
+static void benchPipelineCache(vkb::PhysicalDevice &phys, uint32_t count) {
+  const char *path = "vkb_bench.cache";
+  std::remove(path);
+  for (const char *label : {"cold", "warm"}) {
+    std::vector<vk::Pipeline> pipelines;
+    vkb::Device device;
+    double ms = millis([&] {
+      vkb::DeviceBuilder builder{phys};
+      device = builder.set_pipeline_cache_path(path).build();
+      vk::RenderPass renderpass = createRenderPass(device);
+      PipelineSet set{device, count};
+      pipelines = set.build(device, renderpass);
+      device->destroyRenderPass(renderpass, device.allocation_callbacks);
+    });
+    printf("startup     %-18s %8.1f ms for %u pipelines\n", label, ms, count);
+    destroyPipelines(device, pipelines);
+    device.destroy();
+  }
+  std::remove(path);
+}
+
+static void benchPipelineBatch(vkb::Device &device, vk::RenderPass renderpass, uint32_t count) {
+  std::vector<uint32_t> threads = {1, 2, 4};
+  uint32_t hardware = std::thread::hardware_concurrency();
+  if (hardware > 4)
+    threads.push_back(hardware);
+  for (uint32_t n : threads) {
+    // Fresh builders for a fresh set of create infos, the device has no
+    // pipeline cache.
+    PipelineSet set{device, count};
+    std::vector<vk::Pipeline> pipelines;
+    double ms = millis([&] { pipelines = set.build(device, renderpass, n); });
+    printf("batch       %2u threads:        %8.1f ms for %u pipelines\n", n, ms, count);
+    destroyPipelines(device, pipelines);
+  }
+}
+
+static void benchDispatch(vkb::Device &device, Target &target, uint32_t draws) {
+  vk::CommandPool pool = device.createCommandPool();
+  vk::CommandBuffer cb = device.createCommandBuffers(pool)[0];
+  struct Table { const char *label; const vk::DispatchLoaderDynamic *d; };
+  for (auto table : {Table{"device table:", &device.dispatch()},
+                     Table{"global table:", &VULKAN_HPP_DEFAULT_DISPATCHER}}) {
+    auto &d = *table.d;
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+      target.begin(cb, d);
+      double ms = millis([&] {
+        for (uint32_t i = 0; i < draws; ++i)
+          cb.draw(3, 1, 0, 0, d);
+      });
+      target.end(cb, d);
+      if (run == 0 || ms < best)
+        best = ms;
+    }
+    printf("dispatch    %-18s %8.2f ns per vkCmdDraw\n", table.label, best * 1e6 / draws);
+  }
+  device->destroyCommandPool(pool, device.allocation_callbacks);
+}
+
+int main(int argc, char **argv) {
+  uint32_t frames = argc > 1 ? uint32_t(atoi(argv[1])) : 2000;
+  uint32_t draws = argc > 2 ? uint32_t(atoi(argv[2])) : 100000;
+
+  try {
+    vkb::InstanceBuilder builder;
+    vkb::Instance inst = builder.require_api_version(1, 2).set_headless().build();
+
+    vkb::PhysicalDeviceSelector selector{inst};
+    auto phys = selector.set_minimum_version(1, 0).select();
+    printf("device      %s\n", std::string(phys.properties.deviceName).c_str());
+
+    benchPipelineCache(phys, 128);
+
+    vkb::DeviceBuilder device_builder{phys};
+    vkb::Device device = device_builder.use_device_dispatch().build();
+
+    benchAllocations(device, 1024, 64 * 1024);
+
+    Target target;
+    target.create(device);
+    benchFrames(device, target, frames);
+    benchPipelineBatch(device, target.renderpass, 128);
+    benchDispatch(device, target, draws);
+
+    device->waitIdle();
+    target.destroy(device);
+    device.destroy();
+    inst.destroy();
+  } catch (const std::exception &e) {
+    fprintf(stderr, "vkb_bench: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
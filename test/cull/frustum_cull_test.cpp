@@ -0,0 +1,125 @@
+// Runs FrustumCullPass on a headless device, reads the compacted draws back
+// and compares them with FrustumCullPass::cullReference. Meant for a
+// software implementation such as lavapipe, see LAVAPIPE_ICD in
+// test/CMakeLists.txt. Run from the build directory, next to
+// frustum_cull.spv. Returns non-zero on a mismatch.
+#define VKB_IMPL
+#include "vkbuilder.hpp"
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+
+// Deterministic objects scattered around the camera, partly outside the
+// frustum and partly straddling its planes.
+static std::vector<vkb::IndirectObject> makeObjects(uint32_t count) {
+  uint32_t state = 12345;
+  auto random = [&state](float low, float high) {
+    state = state * 1664525u + 1013904223u;
+    return low + (high - low) * float(state >> 8) / float(1u << 24);
+  };
+  std::vector<vkb::IndirectObject> objects(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    auto &object = objects[i];
+    object.bounds[0] = random(-40.0f, 40.0f);
+    object.bounds[1] = random(-40.0f, 40.0f);
+    object.bounds[2] = random(-60.0f, 10.0f);
+    object.bounds[3] = random(0.1f, 3.0f);
+    object.extents[0] = random(0.1f, 3.0f);
+    object.extents[1] = random(0.1f, 3.0f);
+    object.extents[2] = random(0.1f, 3.0f);
+    object.extents[3] = 0.0f;
+    object.indexCount = 3 * (1 + i % 7);
+    object.firstIndex = 3 * i;
+    object.vertexOffset = int32_t(i);
+    object.firstInstance = i;
+  }
+  return objects;
+}
+
+// Column major perspective projection looking down -Z from the origin,
+// Vulkan [0, 1] depth.
+static vkb::Frustum makeFrustum() {
+  const float fov = 1.0f, aspect = 1.5f, zNear = 0.1f, zFar = 50.0f;
+  float f = 1.0f / std::tan(fov / 2);
+  float m[16] = {
+    f / aspect, 0, 0, 0,
+    0, -f, 0, 0,
+    0, 0, zFar / (zNear - zFar), -1,
+    0, 0, zNear * zFar / (zNear - zFar), 0,
+  };
+  return vkb::Frustum::fromMatrix(m);
+}
+
+static bool runCull(vkb::Device &device, vkb::FrustumCullPass &pass, const std::vector<vkb::IndirectObject> &objects,
+                    const vkb::Frustum &frustum, vkb::FrustumCullPass::Bounds bounds, const char *label) {
+  uint32_t count = static_cast<uint32_t>(objects.size());
+  const vk::MemoryPropertyFlags host = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+
+  vkb::GenericBuffer input(device, vk::BufferUsageFlagBits::eStorageBuffer, count * sizeof(vkb::IndirectObject), host);
+  input.updateLocal(objects);
+  vkb::IndirectDrawBuffer commands(device, count);
+  vkb::GenericBuffer readback(device, vk::BufferUsageFlagBits::eTransferDst, commands.size, host);
+
+  // Twice into the same buffer, the second run must start counting from 0.
+  auto &d = device.dispatch();
+  vkb::SubmitToken token = device.immediate->submit([&](vk::CommandBuffer cb) {
+    for (int run = 0; run < 2; ++run) {
+      pass.record(cb, input, commands, count, frustum, bounds, false);
+      vk::BufferMemoryBarrier written{vk::AccessFlagBits::eShaderWrite,
+                                      vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite |
+                                      vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite,
+                                      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, commands.buffer, 0, VK_WHOLE_SIZE};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                         vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+                         vk::DependencyFlags{}, 0, nullptr, 1, &written, 0, nullptr, d);
+    }
+    vk::BufferCopy region{0, 0, commands.size};
+    cb.copyBuffer(commands.buffer, readback.buffer, 1, &region, d);
+    vk::BufferMemoryBarrier copied{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+                                   VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, readback.buffer, 0, VK_WHOLE_SIZE};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost,
+                       vk::DependencyFlags{}, 0, nullptr, 1, &copied, 0, nullptr, d);
+  });
+  device.immediate->wait(token);
+
+  auto expected = vkb::FrustumCullPass::cullReference(objects, frustum, bounds);
+  auto actual = vkb::FrustumCullPass::readCommands(readback.map());
+  bool same = vkb::FrustumCullPass::sameDraws(expected, actual);
+  printf("%s: %s, %zu of %u visible, GPU wrote %zu\n", label, same ? "ok" : "MISMATCH",
+         expected.size(), count, actual.size());
+
+  pass.clearSets();
+  input.release();
+  commands.release();
+  readback.release();
+  return same;
+}
+
+int main() {
+  try {
+    vkb::InstanceBuilder builder;
+    vkb::Instance inst = builder.require_api_version(1, 2).set_headless().build();
+
+    vkb::PhysicalDeviceSelector selector{inst};
+    auto phys = selector.set_minimum_version(1, 2).select();
+
+    vkb::DeviceBuilder device_builder{phys};
+    vkb::Device device = device_builder.build();
+
+    vkb::FrustumCullPass pass(device, "frustum_cull.spv");
+    auto objects = makeObjects(1000);
+    auto frustum = makeFrustum();
+
+    bool passed = runCull(device, pass, objects, frustum, vkb::FrustumCullPass::Bounds::sphere, "sphere");
+    passed = runCull(device, pass, objects, frustum, vkb::FrustumCullPass::Bounds::aabb, "aabb") && passed;
+
+    pass.release();
+    device.destroy();
+    inst.destroy();
+    return passed ? 0 : 1;
+  } catch (const std::exception &e) {
+    fprintf(stderr, "frustum_cull_test: %s\n", e.what());
+    return 1;
+  }
+}
@@ -34,19 +34,6 @@ struct Vertex {
 
 extern void *create_surface_glfw(void *instance, void *window);
 
-std::vector<uint32_t> readFile(const std::string& filename) {
-  std::ifstream file(filename, std::ios::ate | std::ios::binary);
-  if (!file.is_open()) {
-      throw std::runtime_error("failed to open file!");
-  }
-  size_t file_size = (size_t)file.tellg();
-  std::vector<uint32_t> buffer((file_size + 3) / 4);
-  file.seekg(0);
-  file.read((char*)buffer.data(), static_cast<std::streamsize>(file_size));
-  file.close();
-  return buffer;
-}
-
 class Render {
 public:
   void init(void *window) {
@@ -67,7 +54,11 @@ public:
     vkb::DeviceBuilder device_builder{phys};
 
     // automatically propagate needed data from instance & physical device
-    device = device_builder.build();
+    device = device_builder
+            .set_pipeline_cache_path("pipeline.cache")
+            .use_device_dispatch()
+            .use_timeline_semaphores()
+            .build();
 
     create_swapchain();
     create_pipeline();
@@ -89,12 +80,9 @@ public:
             .addDependency(VK_SUBPASS_EXTERNAL, 0)
             .build();
 
-    auto vert_code = readFile("vert.spv");
-    auto frag_code = readFile("frag.spv");
-
     vkb::PipelineBuilder pipeline_builder{device, swapchain};
     pipeline = pipeline_builder
-        .useClassicPipeline(vert_code, frag_code)
+        .useClassicPipeline("vert.spv", "frag.spv")
         .setVertexInputState(
           vkb::VertexInputStateBuilder()
             .addInputBinding<Vertex>()
@@ -122,11 +110,10 @@ public:
     present.begin();
     present.beginRenderPass(renderpass);
 
-    vk::DeviceSize offset(0);
-    auto& cb = present.getCurrentCommandBuffer();
-    cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
-    cb.bindVertexBuffers(0, 1, buffer, &offset);
-    cb.draw(3, 1, 0, 0);
+    auto recorder = present.getRecorder();
+    recorder.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline)
+            .bindVertexBuffer(0, buffer)
+            .draw(3);
 
     present.endRenderPass();
     present.end();